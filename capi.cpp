@@ -0,0 +1,152 @@
+#include <cstddef>
+
+#include "./mfcc.h"
+#include "./tune.hpp"
+
+using namespace cc;
+
+struct mfcc_plan {
+    wav::config cfg;
+};
+
+namespace {
+thread_local std::string last_error;
+
+// per-thread workspace, so that a shared plan needs no locking
+struct workspace {
+    vec_t              frame_a, frame_b;
+    wav::frame_outputs out_a, out_b;
+};
+thread_local workspace ws;
+
+void defaults(mfcc_config &cfg) {
+    wav::config def;
+    cfg.size     = sizeof(cfg);
+    cfg.frame    = def.frame;
+    cfg.hop      = def.hop;
+    cfg.fft      = def.fft;
+    cfg.channel  = def.channel;
+    cfg.mfcc_dim = def.mfcc_dim;
+    cfg.fmin     = def.fmin;
+    cfg.fmax     = def.fmax;
+    cfg.rate     = def.rate;
+}
+
+bool valid(const wav::config &cfg) {
+    return cfg.frame > 0 && cfg.hop > 0 && cfg.fft >= cfg.frame && cfg.channel > 0 && cfg.mfcc_dim > 0 && cfg.mfcc_dim < cfg.channel &&
+           cfg.fmin >= 0.0f && cfg.fmax >= 0.0f &&
+           ((cfg.fmin == 0.0f && cfg.fmax == 0.0f) || (cfg.rate > 0 && cfg.fmin < (cfg.fmax > 0.0f ? cfg.fmax : cfg.rate / 2.0f)));
+}
+
+template<typename T>
+int compute(const mfcc_plan *plan, const T *samples, size_t n, float scale, float *out, size_t out_frames) {
+    if (!plan || (!samples && n) || !out) {
+        last_error = "invalid argument";
+        return MFCC_EINVAL;
+    }
+    const wav::config &cfg    = plan->cfg;
+    const size_t       frames = wav::frame_count(n, cfg);
+    if (out_frames < frames) {
+        last_error = format_str("output buffer too small: %zu frames required", frames);
+        return MFCC_ESPACE;
+    }
+
+    try {
+        // 2フレームずつまとめて変換する
+        size_t k = 0;
+        for (; k + 1 < frames; k += 2) {
+            wav::frame_at(samples, n, k, scale, cfg, ws.frame_a);
+            wav::frame_at(samples, n, k + 1, scale, cfg, ws.frame_b);
+            wav::analyze(ws.frame_a, ws.frame_b, cfg, ws.out_a, ws.out_b);
+            std::copy(ws.out_a.mfcc.begin(), ws.out_a.mfcc.end(), out + k * cfg.mfcc_dim);
+            std::copy(ws.out_b.mfcc.begin(), ws.out_b.mfcc.end(), out + (k + 1) * cfg.mfcc_dim);
+        }
+        if (k < frames) {
+            wav::frame_at(samples, n, k, scale, cfg, ws.frame_a);
+            wav::analyze(ws.frame_a, cfg, ws.out_a);
+            std::copy(ws.out_a.mfcc.begin(), ws.out_a.mfcc.end(), out + k * cfg.mfcc_dim);
+        }
+    } catch (const std::exception &e) {
+        last_error = e.what();
+        return MFCC_EINTERNAL;
+    }
+    return MFCC_OK;
+}
+} // namespace
+
+extern "C" {
+void mfcc_config_init(mfcc_config *cfg, size_t size) {
+    if (!cfg || size < sizeof(cfg->size)) return;
+    mfcc_config def;
+    defaults(def);
+    def.size = size;
+    memcpy(cfg, &def, std::min(size, sizeof(def)));
+}
+
+mfcc_plan *mfcc_plan_create(const mfcc_config *cfg) {
+    if (!cfg || cfg->size < offsetof(mfcc_config, fmin)) {
+        last_error = "invalid argument";
+        return nullptr;
+    }
+    try {
+        // 呼び出し側の構造体にないフィールドは既定値にする
+        mfcc_config c;
+        defaults(c);
+        memcpy(&c, cfg, std::min(cfg->size, sizeof(c)));
+
+        mfcc_plan *plan = new mfcc_plan();
+        plan->cfg.frame    = c.frame;
+        plan->cfg.hop      = c.hop;
+        plan->cfg.fft      = c.fft;
+        plan->cfg.channel  = c.channel;
+        plan->cfg.mfcc_dim = c.mfcc_dim;
+        plan->cfg.fmin     = c.fmin;
+        plan->cfg.fmax     = c.fmax;
+        plan->cfg.rate     = c.rate;
+        if (!valid(plan->cfg)) {
+            delete plan;
+            last_error = "invalid config";
+            return nullptr;
+        }
+
+        // 保存済みのチューニング結果 (最初の呼び出しで1回だけ読む) を反映する
+        static const wav::tuning_profile profile = [] {
+            wav::tuning_profile p;
+            p.load(wav::tuning_profile::default_path());
+            return p;
+        }();
+        wav::tuning tuned;
+        if (profile.find(plan->cfg, tuned)) {
+            wav::apply(tuned, plan->cfg);
+        }
+        return plan;
+    } catch (const std::exception &e) {
+        last_error = e.what();
+        return nullptr;
+    }
+}
+
+void mfcc_plan_destroy(mfcc_plan *plan) {
+    delete plan;
+}
+
+int mfcc_plan_dim(const mfcc_plan *plan) {
+    return plan ? plan->cfg.mfcc_dim : 0;
+}
+
+size_t mfcc_frame_count(const mfcc_plan *plan, size_t samples) {
+    return plan ? wav::frame_count(samples, plan->cfg) : 0;
+}
+
+int mfcc_compute_f32(const mfcc_plan *plan, const float *samples, size_t n, float *out, size_t out_frames) {
+    return compute(plan, samples, n, 1.0f, out, out_frames);
+}
+
+int mfcc_compute_s16(const mfcc_plan *plan, const int16_t *samples, size_t n, float *out, size_t out_frames) {
+    return compute(plan, samples, n, 1.0f / 32768.0f, out, out_frames);
+}
+
+const char *mfcc_last_error(void) {
+    return last_error.c_str();
+}
+} // extern "C"
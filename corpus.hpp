@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./tune.hpp"
+
+namespace wav {
+/********************************************************************************
+ *
+ * corpus
+ *
+ * featurizes every wav file listed in a manifest (one path per line, blank lines
+ * and lines starting with '#' are ignored). entry i belongs to shard i % shards,
+ * and the shards are split over worker processes (shard s runs on worker
+ * s % workers). each shard appends its utterances as consecutive feature_file
+ * records to its own file and logs a checkpoint line after every record:
+ *
+ *   <out>.shard<k>.feat  : feature_file records, back to back
+ *   <out>.shard<k>.done  : ok   <index> <offset> <bytes> <frames> <path>
+ *                          fail <index> <message> <path>
+ *
+ * the record is flushed before its checkpoint, so after a crash a restart keeps
+ * every "ok" entry, cuts the shard file back to the end of the last one and
+ * carries on from there (failed entries are tried again). when all workers have
+ * exited, the checkpoints are merged into a global index in manifest order:
+ *
+ *   <out>.index          : <path> <shard file> <offset> <frames>
+ *
+ * all files are tab separated. the first line of a .done file holds the config
+ * and storage it was written with. a shard written with other settings is
+ * started over, and is left out of the merge (its entries count as missing)
+ * until it has been redone.
+ *
+ ********************************************************************************/
+class corpus {
+public:
+    struct options {
+        std::string out;                      // 出力ファイル名の接頭辞
+        size_t      workers = 1;              // ワーカープロセス数
+        size_t      shards  = 0;              // 0 ならワーカー数と同じ
+        storage     type    = STORE_F32;
+        scaling     mode    = SCALE_UTTERANCE;
+    };
+
+    struct summary {
+        size_t                   entries = 0;
+        size_t                   done    = 0;
+        std::vector<std::string> failed;  // "<path>: <message>"
+        std::vector<std::string> missing; // チェックポイントがないもの (ワーカーが途中で落ちた)
+    };
+
+    static std::string shard_path(const std::string &out, size_t k) {return format_str("%s.shard%zu.feat", out.c_str(), k); }
+    static std::string done_path(const std::string &out, size_t k)  {return format_str("%s.shard%zu.done", out.c_str(), k); }
+    static std::string index_path(const std::string &out)           {return out + ".index"; }
+
+    static void read_manifest(const std::string &path, std::vector<std::string> &entries) {
+        std::ifstream ifs(path);
+        if (!ifs) {
+            throw std::runtime_error(format_str("failed to open %s", path.c_str()));
+        }
+        entries.clear();
+        for (std::string line; std::getline(ifs, line);) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            entries.push_back(line);
+        }
+    }
+
+    /**
+     * マニフェストの全エントリを処理し、グローバルインデックスを書く
+     */
+    static summary run(const std::string &manifest, const config &cfg, options opt) {
+        std::vector<std::string> entries;
+        read_manifest(manifest, entries);
+        opt.workers = std::max<size_t>(opt.workers, 1);
+        if (opt.shards == 0) opt.shards = opt.workers;
+        opt.workers = std::min(opt.workers, opt.shards);
+
+        // 子プロセスに未出力のバッファを複製させない
+        std::cout.flush();
+        std::cerr.flush();
+
+        std::vector<pid_t> pids;
+        for (size_t p = 0; p < opt.workers; p++) {
+            const pid_t pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error(format_str("failed to fork worker %zu", p));
+            }
+            if (pid == 0) {
+                int code = 0;
+                try {
+                    for (size_t s = p; s < opt.shards; s += opt.workers) {
+                        run_shard(entries, s, cfg, opt);
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << colorant('y', format_str("error: worker %zu: %s", p, e.what())) << std::endl;
+                    code = 1;
+                }
+                std::cout.flush();
+                _exit(code);
+            }
+            pids.push_back(pid);
+        }
+
+        for (auto pid : pids) {
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        }
+        return merge(entries, cfg, opt);
+    }
+
+    /**
+     * 1つのシャードを処理する (チェックポイントがあれば続きから)
+     */
+    static void run_shard(const std::vector<std::string> &entries, size_t shard, const config &cfg, const options &opt) {
+        const std::string feat_fn = shard_path(opt.out, shard);
+        const std::string done_fn = done_path(opt.out, shard);
+        const std::string key     = key_of(cfg, opt);
+
+        // 終わっているエントリを集め、最後の完了レコードの後ろを捨てる
+        std::map<size_t, checkpoint> ok;
+        load_checkpoints(done_fn, key, entries, ok, nullptr);
+        uint64_t end = 0;
+        for (auto &c : ok) {
+            end = std::max(end, c.second.offset + c.second.bytes);
+        }
+        if (file_size(feat_fn) < end) {
+            ok.clear();
+            end = 0;
+        }
+
+        {
+            std::ofstream ofs(feat_fn, std::ios::out | std::ios::binary | std::ios::app);
+            if (!ofs || truncate(feat_fn.c_str(), end) != 0) {
+                throw std::runtime_error(format_str("failed to write %s", feat_fn.c_str()));
+            }
+        }
+
+        // 残したチェックポイントだけで .done を書き直す (途中で切れた行を消す)
+        {
+            std::ofstream done(done_fn + ".tmp", std::ios::out | std::ios::trunc);
+            done << "#\t" << key << "\n";
+            for (auto &c : ok) {
+                write_ok(done, c.first, c.second, entries[c.first]);
+            }
+            done.close();
+            if (!done || rename((done_fn + ".tmp").c_str(), done_fn.c_str()) != 0) {
+                throw std::runtime_error(format_str("failed to write %s", done_fn.c_str()));
+            }
+        }
+
+        std::fstream  ofs(feat_fn, std::ios::in | std::ios::out | std::ios::binary);
+        std::ofstream done(done_fn, std::ios::out | std::ios::app);
+        if (!ofs || !done) {
+            throw std::runtime_error(format_str("failed to open %s", feat_fn.c_str()));
+        }
+        ofs.seekp(end);
+
+        // 読み込みと計算を重ねるため、残りのエントリをパイプラインに流す (ワーカー1つにつき計算レーン1本)
+        std::vector<size_t>      pending;
+        std::vector<std::string> files;
+        for (size_t i = shard; i < entries.size(); i += opt.shards) {
+            if (ok.count(i)) continue;
+            pending.push_back(i);
+            files.push_back(entries[i]);
+        }
+
+        size_t      n_done = 0, n_failed = 0;
+        std::string fatal;
+        pipeline    pipe(cfg, 1, 4, true);
+        pipe.run(files, [&](const job &j) {
+            const size_t i = pending[j.id];
+            if (!fatal.empty()) {
+                return;
+            }
+            std::string message = j.error;
+            if (message.empty()) {
+                try {
+                    checkpoint c;
+                    c.offset = end;
+                    feature_file::write(ofs, j.frames, opt.type, opt.mode);
+                    ofs.flush();
+                    if (!ofs) {
+                        fatal = format_str("failed to write %s", feat_fn.c_str());
+                        return;
+                    }
+                    end      = (uint64_t)ofs.tellp();
+                    c.bytes  = end - c.offset;
+                    c.frames = j.frames.size();
+
+                    write_ok(done, i, c, entries[i]);
+                    done.flush();
+                    n_done++;
+                    return;
+                } catch (const std::exception &e) {
+                    // 書きかけのレコードは次のレコードで上書きする
+                    ofs.seekp(end);
+                    message = e.what();
+                }
+            }
+            std::replace(message.begin(), message.end(), '\t', ' ');
+            std::replace(message.begin(), message.end(), '\n', ' ');
+            done << "fail\t" << i << "\t" << message << "\t" << entries[i] << "\n";
+            done.flush();
+            n_failed++;
+        });
+        if (!fatal.empty()) {
+            throw std::runtime_error(fatal);
+        }
+
+        // 失敗したエントリの後に書きかけのレコードが残っていれば捨てる
+        ofs.close();
+        if (truncate(feat_fn.c_str(), end) != 0) {
+            throw std::runtime_error(format_str("failed to write %s", feat_fn.c_str()));
+        }
+        std::cout << format_str("shard %zu: %zu done, %zu skipped, %zu failed", shard, n_done, ok.size(), n_failed) << std::endl;
+    }
+
+    /**
+     * 全シャードのチェックポイントをマニフェスト順のインデックスにまとめる
+     * (設定の違う .done は使わず、そのエントリは未処理として報告する)
+     */
+    static summary merge(const std::vector<std::string> &entries, const config &cfg, const options &opt) {
+        const std::string key = key_of(cfg, opt);
+        std::vector<const checkpoint *> found(entries.size(), nullptr);
+        std::vector<std::string>        errors(entries.size());
+        std::vector<std::map<size_t, checkpoint>> ok(opt.shards);
+        for (size_t s = 0; s < opt.shards; s++) {
+            std::map<size_t, std::string> failed;
+            load_checkpoints(done_path(opt.out, s), key, entries, ok[s], &failed);
+            for (auto &c : ok[s]) {
+                if (c.first % opt.shards == s) found[c.first] = &c.second;
+            }
+            for (auto &f : failed) {
+                if (f.first % opt.shards == s) errors[f.first] = f.second;
+            }
+        }
+
+        summary           sum;
+        const std::string fn = index_path(opt.out);
+        std::ofstream     ofs(fn + ".tmp", std::ios::out | std::ios::trunc);
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (found[i]) {
+                ofs << entries[i] << "\t" << shard_path(opt.out, i % opt.shards) << "\t" << found[i]->offset << "\t" << found[i]->frames << "\n";
+                sum.done++;
+            } else if (!errors[i].empty()) {
+                sum.failed.push_back(entries[i] + ": " + errors[i]);
+            } else {
+                sum.missing.push_back(entries[i]);
+            }
+        }
+        ofs.close();
+        if (!ofs || rename((fn + ".tmp").c_str(), fn.c_str()) != 0) {
+            throw std::runtime_error(format_str("failed to write %s", fn.c_str()));
+        }
+        sum.entries = entries.size();
+        return sum;
+    }
+
+    /**
+     * シャードファイルの offset から1発話分を読む
+     */
+    static void read(const std::string &shard_fn, uint64_t offset, std::vector<vec_t> &feats) {
+        std::ifstream ifs(shard_fn, std::ios::in | std::ios::binary);
+        if (!ifs) {
+            throw std::runtime_error(format_str("failed to open %s", shard_fn.c_str()));
+        }
+        ifs.seekg(offset);
+        feature_file::read(ifs, feats, shard_fn);
+    }
+
+private:
+    /**
+     * .done の先頭行 (出力を変える設定)
+     */
+    static std::string key_of(const config &cfg, const options &opt) {
+        return format_str("%s store=%u scaling=%u shards=%zu", tuning_key(cfg).c_str(), opt.type, opt.mode, opt.shards);
+    }
+
+    struct checkpoint {
+        uint64_t offset = 0;
+        uint64_t bytes  = 0;
+        uint64_t frames = 0;
+    };
+
+    static void write_ok(std::ostream &os, size_t i, const checkpoint &c, const std::string &path) {
+        os << "ok\t" << i << "\t" << c.offset << "\t" << c.bytes << "\t" << c.frames << "\t" << path << "\n";
+    }
+
+    static uint64_t file_size(const std::string &fn) {
+        std::ifstream ifs(fn, std::ios::in | std::ios::binary | std::ios::ate);
+        return ifs ? (uint64_t)ifs.tellg() : 0;
+    }
+
+    /**
+     * .done を読む (先頭行が key と一致しなければ何も読まずに false を返す)
+     */
+    static bool load_checkpoints(const std::string &fn, const std::string &key, const std::vector<std::string> &entries,
+                                 std::map<size_t, checkpoint> &ok, std::map<size_t, std::string> *failed) {
+        std::ifstream ifs(fn);
+        if (!ifs) {
+            return false;
+        }
+        std::string line;
+        if (!std::getline(ifs, line) || line != "#\t" + key) {
+            return false;
+        }
+        while (std::getline(ifs, line)) {
+            if (ifs.eof()) break; // 改行で終わっていない行は書きかけ
+
+            std::vector<std::string> cols;
+            std::stringstream        ss(line);
+            for (std::string col; std::getline(ss, col, '\t');) {
+                cols.push_back(col);
+            }
+
+            // マニフェストが変わっていたら別のエントリとして扱う
+            char *end;
+            if (cols.size() < 2) continue;
+            const size_t i = strtoul(cols[1].c_str(), &end, 10);
+            if (*end != '\0' || i >= entries.size() || cols.back() != entries[i]) continue;
+
+            if (cols[0] == "ok" && cols.size() == 6) {
+                checkpoint c;
+                c.offset = std::stoull(cols[2]);
+                c.bytes  = std::stoull(cols[3]);
+                c.frames = std::stoull(cols[4]);
+                ok[i]    = c;
+                if (failed) failed->erase(i);
+            } else if (cols[0] == "fail" && cols.size() == 4 && failed) {
+                (*failed)[i] = cols[2];
+            }
+        }
+        return true;
+    }
+};
+} // namespace wav
@@ -1,261 +1,339 @@
-#include "./util.hpp"
+#include "./mfcc.hpp"
+#include "./tune.hpp"
+#include "./corpus.hpp"
 
 using namespace cc;
 
-namespace wav {
-typedef struct {
-    char           riff_id[4];   // "riff"
-    unsigned int   size;         // filesize - 8
-    char           wav_id[4];    // "WAVE"
-    char           fmt_id[4];    // "fmt "
-    unsigned int   fmt_size;     // fmtチャンクのバイト数
-    unsigned short format;       // フォーマット
-    unsigned short channels;     // チャンネル数
-    unsigned int   sample_rate;  // サンプリングレート
-    unsigned int   byte_per_sec; // データ速度
-    unsigned short block_size;   // ブロックサイズ
-    unsigned short bit;          // 量子化ビット数
-    char           data_id[4];   // "data"
-    unsigned int   data_size;    // 波形データのバイト数
-} header;
-
 /**
- * ref : https://gist.github.com/yomakkkk/2290842
+ * --key=value 形式のオプションと位置引数を分ける
  */
-void read(std::string fn, vec_t &data) {
-    wav::header   header;
-    std::ifstream ifs(fn, std::ios::in | std::ios::binary);
-    if (!ifs) {
-        throw std::runtime_error(format_str("failed to open %s", fn.c_str()));
-    }
-
-    ifs.read((char *)&header, sizeof(header));
-
-    while (!ifs.eof()) {
-        short buf;
-        ifs.read((char *)&buf, sizeof(buf));
-        data.push_back((float)buf / pow(2.0f, header.bit - 1)); // normalize to -1.0 ~ 1.0
-    }
-    ifs.close();
-}
-
-// void write(std::string fn, std::vector<short> &data, header &header) {
-//     std::ofstream ofs(fn, std::ios::out | std::ios::binary | std::ios::trunc);
-//     if (!ofs) {
-//         throw std::runtime_error(format_str("failed to write %s", fn));
-//     }
-//
-//     header.data_size = data.size();
-//     ofs.write((char *)&header, sizeof(header));
-//
-//     auto it = data.begin();
-//     while (it != data.end()) {
-//         short buf = *(it++);
-//         ofs.write((char *)&buf, sizeof(buf));
-//     }
-//     ofs.close();
-// }
-
-void pre_emphasis(vec_t &r) {
-    vec_t tmp(r.size());
-
-    tmp[0] = r[0];
-
-    // ignore first element
-    for (size_t i = 1; i < r.size(); i++) {
-        tmp[i] = r[i] - 0.97 * r[i - 1];
-    }
-
-    std::copy(tmp.begin(), tmp.end(), r.begin());
-}
-
-void window_hanning(vec_t &r) {
-    size_t N = r.size();
-
-    // apply hanning window
-    for (size_t i = 0; i < N; i++) {
-        r[i] *= (0.5 - 0.5 * cos(2 * M_PI * i / (N - 1)));
-    }
-}
-
-void fourier(const vec_t &raw, vec_t &re, vec_t &im) {
-    int N    = raw.size();
-    int FREQ = re.size();
-
-    std::fill(re.begin(), re.end(), 0.0f);
-    std::fill(im.begin(), im.end(), 0.0f);
-
-    // apply fourier transform
-    for (int i = 0; i < FREQ; i++) {
-        for (int k = 0; k < N; k++) {
-            re[i] += (float)raw[k]  * cos(2.0f * M_PI * k * i / FREQ);
-            im[i] += (float)-raw[k] * sin(2.0f * M_PI * k * i / FREQ);
+void parse_args(int argc, char *argv[], std::map<std::string, std::string> &opts, std::vector<std::string> &args) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a.compare(0, 2, "--") == 0) {
+            size_t eq = a.find('=');
+            if (eq == std::string::npos) {
+                opts[a.substr(2)] = "1";
+            } else {
+                opts[a.substr(2, eq - 2)] = a.substr(eq + 1);
+            }
+        } else {
+            args.push_back(a);
         }
     }
 }
 
-void amplitude(const vec_t &re, const vec_t &im, vec_t &amp) {
-    int N = re.size();
-
-    for (int i = 0; i < N; i++) {
-        amp[i] = sqrt(re[i] * re[i] + im[i] * im[i]);
-    }
-}
-
-float hz2mel(float f) {
-    return 1127.01048 * std::log(f / 700.0 + 1.0);
-}
-
-float mel2hz(float m) {
-    return 700.0 * (std::exp(m / 1127.01048) - 1.0);
-}
-
-void melfilter(vec_t &amp, vec_t &mel_x, vec_t &mel_y) {
-    int NYQ     = amp.size();
-    int channel = 20;
-
-    int   melmax = hz2mel(NYQ);
-    float df     = 1;
-    float dmel   =  melmax / (channel + 1);
-
-    vec_t            m_centers(channel);
-    vec_t            f_centers(channel);
-    std::vector<int> i_centers(channel);
-    for (int i = 0; i < channel; i++) {
-        m_centers[i] = (i + 1) * dmel;
-        f_centers[i] = mel2hz(m_centers[i]);
-        i_centers[i] = (int)(f_centers[i] / df);
-    }
-    mel_x = f_centers;
-
-    std::vector<int> i_s(channel);
-    std::vector<int> i_e(channel);
-    for (int i = 0; i < channel; i++) {
-        i_s[i] = (i - 1) == -1      ? 0   : i_centers[i - 1];
-        i_e[i] = (i + 1) == channel ? NYQ : i_centers[i + 1];
-    }
-
-    std::vector<vec_t> bank;
-    for (int c = 0; c < channel; c++) {
-        vec_t filter(NYQ);
+int main(int argc, char *argv[]) {
+    try {
+        std::map<std::string, std::string> opts;
+        std::vector<std::string>           files;
+        parse_args(argc, argv, opts, files);
 
-        for (int i = i_s[c]; i < i_centers[c]; i++) {
-            filter[i] = (1.0f / (i_centers[c] - i_s[c])) * (i - i_s[c]);
+        if (files.empty()) {
+            files.push_back("a.wav");
         }
 
-        for (int i = i_centers[c]; i < i_e[c]; i++) {
-            filter[i] = 1.0 - (1.0f / (i_e[c] - i_centers[c])) * (i - i_centers[c]);
+        wav::config cfg;
+        if (opts.count("hop")) cfg.hop = std::stoi(opts["hop"]);
+        if (opts.count("fmin")) cfg.fmin = std::stof(opts["fmin"]);
+        if (opts.count("fmax")) cfg.fmax = std::stof(opts["fmax"]);
+        if (opts.count("rate")) cfg.rate = std::stoi(opts["rate"]); // 既定は各ファイルのヘッダの値
+
+        // 帯域のビンはサンプリング周波数で変わるので、チューニング結果は先頭のファイルのレートで引く
+        int first_rate = 0;
+        try {
+            wav::source src;
+            wav::open(files[0], src);
+            first_rate = src.header.sample_rate;
+        } catch (const std::exception &) {
+            // 開けなければ --rate の指定だけで引く
         }
-        bank.push_back(filter);
-    }
-
-    for (int c = 0; c < channel; c++) {
-        float sum = 0.0f;
-        for (int i = 0; i < NYQ; i++) {
-            sum += amp[i] * bank[c][i];
+        const wav::config tuned_for = wav::with_rate(cfg, first_rate);
+
+        // 保存済みのチューニング結果があれば使う (明示したオプションが優先)
+        wav::tuning_profile profile;
+        wav::tuning         tuned;
+        const std::string   profile_path = opts.count("tuning") ? opts["tuning"] : wav::tuning_profile::default_path();
+        const bool          has_tuning   = profile.load(profile_path) && profile.find(tuned_for, tuned);
+        if (has_tuning) {
+            wav::apply(tuned, cfg);
+            simd_width() = std::min(tuned.simd, detect_simd_width());
         }
-        mel_y[c] = sum;
-    }
-}
-
-/**
- * ref : http://tony-mooori.blogspot.jp/2016/02/dctpythonpython.html
- */
-void dct(vec_t &s, vec_t &d) {
-    int N = s.size();
 
-    std::fill(d.begin(), d.end(), 0.0f);
+        if (opts.count("radix")) cfg.radix = std::stoi(opts["radix"]);
+        if (opts.count("tile")) cfg.tile = std::stoi(opts["tile"]);
+        if (opts.count("sliding")) cfg.transform = wav::TRANSFORM_SLIDING;
+        if (opts.count("transform")) {
+            const std::string t = opts["transform"];
+            if (t == "dft") cfg.transform = wav::TRANSFORM_DFT;
+            else if (t == "sliding") cfg.transform = wav::TRANSFORM_SLIDING;
+            else if (t == "fft") cfg.transform = wav::TRANSFORM_FFT;
+            else throw std::runtime_error(format_str("unknown transform %s (dft, sliding, fft)", t.c_str()));
+        }
+        if (opts.count("anchor")) cfg.anchor = std::stoi(opts["anchor"]);
+        if (opts.count("zoom")) cfg.zoom = std::stoi(opts["zoom"]);
+        if (cfg.hop <= 0) {
+            throw std::runtime_error("hop must be positive");
+        }
 
-    for (int k = 0; k < N; k++) {
-        for (int i = 0; i < N; i++) {
-            if (k == 0) {
-                d[k] += s[i] * sqrt(1.0f / N);
-            } else {
-                d[k] += s[i] * sqrt(2.0f / N) * cos((2 * i + 1) * k * M_PI / 2.0f / N);
+        // 候補を実測して速いものを選び、プロファイルに保存する
+        if (opts.count("autotune")) {
+            // 合成した入力で測るので、帯域の換算には先頭のファイルのサンプリング周波数を使う
+            tuned = wav::autotune(tuned_for, &std::cout);
+            profile.set(tuned_for, tuned);
+            profile.save(profile_path);
+            std::cout << format_str("transform=%d zoom=%d radix=%d tile=%d threads=%d simd=%d",
+                                    tuned.transform, tuned.zoom, tuned.radix, tuned.tile, tuned.threads, tuned.simd) << std::endl;
+            std::cout << "wrote " << profile_path << std::endl;
+            return 0;
+        }
+        const size_t default_threads = has_tuning ? tuned.threads : std::max(std::thread::hardware_concurrency(), 1u);
+
+        // 計算レーン数 (既定はコア数から reader/decoder/writer の分を引いたもの)
+        size_t hw    = std::max(std::thread::hardware_concurrency(), 1u);
+        size_t lanes = opts.count("threads") ? std::stoul(opts["threads"]) : has_tuning ? tuned.threads : std::max<size_t>(hw > 3 ? hw - 3 : 1, 1);
+        size_t depth = opts.count("depth") ? std::stoul(opts["depth"]) : 2 * lanes + 2;
+
+        // 同じ音声を複数のライブストリームとして流し込み、エンジンの遅延を測る
+        if (opts.count("streams")) {
+            wav::source src;
+            wav::open(files[0], src);
+            vec_t signal;
+            wav::read(src, 0, src.samples, signal);
+
+            const size_t n_streams = std::stoul(opts["streams"]);
+            const size_t chunk     = opts.count("chunk") ? std::stoul(opts["chunk"]) : cfg.hop / 2;
+            const size_t workers   = opts.count("threads") ? std::stoul(opts["threads"]) : default_threads;
+            const size_t pending   = opts.count("max-pending") ? std::stoul(opts["max-pending"]) : 8;
+            const size_t batch     = opts.count("batch") ? std::stoul(opts["batch"]) : 4;
+            const double budget    = (double)cfg.hop / src.header.sample_rate;
+
+            wav::engine eng(wav::with_rate(cfg, src.header.sample_rate), workers, budget, pending, batch, [](int, size_t, const wav::frame_outputs &) {});
+            std::vector<int> ids;
+            for (size_t i = 0; i < n_streams; i++) {
+                ids.push_back(eng.open());
+            }
+            for (size_t pos = 0; pos < signal.size(); pos += chunk) {
+                const size_t n = std::min(chunk, signal.size() - pos);
+                for (int id : ids) {
+                    backoff b;
+                    for (size_t done = 0; done < n;) {
+                        const size_t taken = eng.push(id, &signal[pos + done], n - done);
+                        done += taken;
+                        if (!taken) {
+                            b.pause();
+                        }
+                    }
+                }
             }
+            eng.drain();
+
+            for (int id : ids) {
+                auto m = eng.stats(id);
+                std::cout << format_str("stream %3d: frames %zu missed %zu rejected %zu errors %zu lag mean %.3f ms max %.3f ms",
+                                        id, m.frames_out, m.missed, m.rejected, m.errors, m.mean_lag * 1e3, m.max_lag * 1e3) << std::endl;
+                if (m.errors) {
+                    std::cerr << colorant('y', format_str("error: stream %d: %s", id, eng.error(id).c_str())) << std::endl;
+                }
+            }
+            std::cout << format_str("latency p50 %.3f ms p99 %.3f ms", eng.latency_percentile(0.50) * 1e3, eng.latency_percentile(0.99) * 1e3) << std::endl;
+            return 0;
         }
-    }
-}
 
-void idct(vec_t &s, vec_t &d) {
-    int N = s.size();
+        // フレームインデックスを作る
+        if (opts.count("build-index")) {
+            wav::pipeline pipe(cfg, lanes, depth, true);
+            pipe.run(files, [&](const wav::job &j) {
+                if (!j.error.empty()) {
+                    std::cerr << colorant('y', format_str("error: %s", j.error.c_str())) << std::endl;
+                    return;
+                }
+                try {
+                    wav::source src;
+                    wav::open(j.fn, src);
+                    wav::frame_index::build(src, cfg, j.frames);
+                    std::cout << "wrote " << wav::frame_index::path(j.fn) << std::endl;
+                } catch (const std::exception &e) {
+                    std::cerr << colorant('y', format_str("error: %s", e.what())) << std::endl;
+                }
+            });
+            return 0;
+        }
 
-    std::fill(d.begin(), d.end(), 0.0f);
+        // テンプレート (カンマ区切りのwavファイル) を各ファイルの中から探す
+        if (opts.count("search")) {
+            const size_t k       = opts.count("top") ? std::stoul(opts["top"]) : 5;
+            const float  band    = opts.count("band") ? std::stof(opts["band"]) : 0.1f;
+            const float  zone    = opts.count("exclusion") ? std::stof(opts["exclusion"]) : 1.0f;
+            const size_t threads = opts.count("threads") ? std::stoul(opts["threads"]) : default_threads;
+
+            auto features_of = [&](const std::string &fn, std::vector<vec_t> &feats, double &rate) {
+                wav::source src;
+                wav::open(fn, src);
+                wav::segment(src, 0, wav::frame_count(src.samples, cfg), cfg, feats);
+                rate = src.header.sample_rate;
+            };
+
+            wav::template_index index(band, zone);
+            std::stringstream   ss(opts["search"]);
+            for (std::string fn; std::getline(ss, fn, ',');) {
+                std::vector<vec_t> feats;
+                double             rate;
+                features_of(fn, feats, rate);
+                index.add(fn, feats);
+            }
 
-    for (int k = 0; k < N; k++) {
-        for (int i = 0; i < N; i++) {
-            if (k == 0) {
-                d[i] += s[k] * sqrt(1.0f / N);
-            } else {
-                d[i] += s[k] * sqrt(2.0f / N) * cos((2 * i + 1) * k * M_PI / 2.0f / N);
+            for (auto &fn : files) {
+                std::vector<vec_t> feats;
+                double             rate;
+                features_of(fn, feats, rate);
+
+                if (files.size() > 1) {
+                    std::cout << "# " << fn << std::endl;
+                }
+                for (auto &m : index.search(feats, k, threads)) {
+                    std::cout << format_str("%s %zu %.6f %g", index.name(m.tpl).c_str(), m.offset, (double)m.offset * cfg.hop / rate, m.distance) << std::endl;
+                }
             }
+            return 0;
         }
-    }
-}
-
-void log_spectrum(vec_t &a) {
-    int N = a.size();
-
-    for (int i = 0; i < N; i++) {
-        a[i] = 20.0f * log10f(a[i]);
-    }
-}
-} // namespace wav
-
-int main(int argc, char *argv[]) {
-    try {
-        vec_t raw;
 
-        // 音声データを読み込む
-        wav::read("a.wav", raw);
-
-        // リサイズする
-        const int N = 1024;
-        raw.resize(N);
-
-        // プリエンファシスをかけて高音を強調する
-        wav::pre_emphasis(raw);
-
-        // ハニング窓関数をかける
-        wav::window_hanning(raw);
-
-        // フーリエ変換する
-        const int FRQ = 44000;
-        vec_t     re(FRQ);
-        vec_t     im(FRQ);
-        wav::fourier(raw, re, im);
-
-        // 振幅スペクトルにする
-        vec_t amp(FRQ);
-        wav::amplitude(re, im, amp);
-
-        // ナイキスト周波数でカットする
-        const int NYQ = FRQ / 2;
-        amp.resize(NYQ);
-
-        // メルフィルタバンクと内積をとって次元を減らす
-        const int DIM = 20;
-        vec_t     mel_x(DIM);
-        vec_t     mel_y(DIM);
-        wav::melfilter(amp, mel_x, mel_y);
-
-        // 対数スペクトルに変換する
-        wav::log_spectrum(mel_y);
+        const std::string type = opts.count("store") ? opts["store"] : "f32";
+        wav::storage      storage;
+        if (type == "f32") storage = wav::STORE_F32;
+        else if (type == "f16") storage = wav::STORE_F16;
+        else if (type == "int8") storage = wav::STORE_INT8;
+        else throw std::runtime_error(format_str("unknown storage type %s (f32, f16, int8)", type.c_str()));
+        const std::string scale = opts.count("scaling") ? opts["scaling"] : "utt";
+        wav::scaling      mode;
+        if (scale == "utt") mode = wav::SCALE_UTTERANCE;
+        else if (scale == "dim") mode = wav::SCALE_DIMENSION;
+        else throw std::runtime_error(format_str("unknown scaling %s (utt, dim)", scale.c_str()));
+
+        // マニフェストのファイルをシャードに分けてワーカープロセスで処理する (再実行すると続きから)
+        if (opts.count("corpus")) {
+            wav::corpus::options opt;
+            opt.out     = opts.count("out") ? opts["out"] : opts["corpus"];
+            opt.workers = opts.count("workers") ? std::stoul(opts["workers"]) : default_threads;
+            opt.shards  = opts.count("shards") ? std::stoul(opts["shards"]) : 0;
+            opt.type    = storage;
+            opt.mode    = mode;
+
+            auto sum = wav::corpus::run(opts["corpus"], cfg, opt);
+            for (auto &f : sum.failed) {
+                std::cerr << colorant('y', format_str("failed: %s", f.c_str())) << std::endl;
+            }
+            for (auto &m : sum.missing) {
+                std::cerr << colorant('y', format_str("missing: %s", m.c_str())) << std::endl;
+            }
+            std::cout << format_str("%zu/%zu done, %zu failed, %zu missing", sum.done, sum.entries, sum.failed.size(), sum.missing.size()) << std::endl;
+            std::cout << "wrote " << wav::corpus::index_path(opt.out) << std::endl;
+            return 0;
+        }
 
-        // 離散コサイン変換 (DCT-II) でケプストラム領域に移す
-        vec_t cepstrum(DIM);
-        wav::dct(mel_y, cepstrum);
+        // 全フレームのMFCCを量子化して <wav>.feat に保存する
+        if (opts.count("store")) {
+
+            wav::pipeline pipe(cfg, lanes, depth, true);
+            pipe.run(files, [&](const wav::job &j) {
+                if (!j.error.empty()) {
+                    std::cerr << colorant('y', format_str("error: %s", j.error.c_str())) << std::endl;
+                    return;
+                }
+                try {
+                    const std::string path = wav::feature_file::path(j.fn);
+                    wav::feature_file::write(path, j.frames, storage, mode);
+                    std::cout << "wrote " << path << std::endl;
+
+                    if (opts.count("report")) {
+                        std::vector<vec_t> restored;
+                        wav::feature_file::read(path, restored);
+                        auto a = wav::compare(j.frames, restored);
+                        std::cout << format_str("  near %zu/%zu elements, %zu/%zu frames, max abs err %.5f, rms err %.5f",
+                                                a.near, a.elements, a.frames_near, a.frames, a.max_abs, a.rms) << std::endl;
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << colorant('y', format_str("error: %s", e.what())) << std::endl;
+                }
+            });
+            return 0;
+        }
 
-        // リフタリングで定常成分と高次成分を除去してMFCCを得る
-        const int MFCC_DIM = 12;
-        vec_t     mfcc(MFCC_DIM);
-        std::copy(cepstrum.begin() + 1, cepstrum.begin() + MFCC_DIM + 1, mfcc.begin());
+        // 1回の解析で複数の中間結果をそれぞれのシンクに書き出す
+        wav::sinks out;
+        if (opts.count("out-spec"))   out.spec.reset(new wav::sink(opts["out-spec"]));
+        if (opts.count("out-fbank"))  out.fbank.reset(new wav::sink(opts["out-fbank"]));
+        if (opts.count("out-mfcc"))   out.mfcc.reset(new wav::sink(opts["out-mfcc"]));
+        if (opts.count("out-energy")) out.energy.reset(new wav::sink(opts["out-energy"]));
+        if (out.mask()) {
+            const double t0 = opts.count("t0") ? std::stod(opts["t0"]) : 0.0;
+            const double t1 = opts.count("t1") ? std::stod(opts["t1"]) : std::numeric_limits<double>::infinity(); // 既定はファイルの終わりまで
+            for (auto &fn : files) {
+                wav::source src;
+                wav::open(fn, src);
+
+                size_t first, last;
+                wav::frame_range(src, t0, t1, cfg, first, last);
+
+                if (files.size() > 1) {
+                    out.comment(fn);
+                }
+                wav::segment(src, first, last, cfg, [&](size_t, const wav::frame_outputs &o) {
+                    out.write(o);
+                });
+            }
+            out.flush();
+            return 0;
+        }
 
-        for (auto f : mfcc) {
-            std::cout << f << std::endl;
+        // 区間 [t0, t1) のフレームだけを計算する (インデックスがあればそこから引く)
+        if (opts.count("t0") || opts.count("t1")) {
+            const double t0 = opts.count("t0") ? std::stod(opts["t0"]) : 0.0;
+            const double t1 = opts.count("t1") ? std::stod(opts["t1"]) : std::numeric_limits<double>::infinity(); // 既定はファイルの終わりまで
+            for (auto &fn : files) {
+                wav::source src;
+                wav::open(fn, src);
+
+                size_t first, last;
+                wav::frame_range(src, t0, t1, cfg, first, last);
+
+                std::vector<vec_t> feats;
+                wav::frame_index   index;
+                if (index.open(src, cfg)) {
+                    index.read(first, last, feats);
+                } else {
+                    wav::segment(src, first, last, cfg, feats);
+                }
+
+                if (files.size() > 1) {
+                    std::cout << "# " << fn << std::endl;
+                }
+                for (size_t k = first; k < last; k++) {
+                    std::cout << format_str("%zu %.6f", k, (double)k * cfg.hop / src.header.sample_rate);
+                    for (auto f : feats[k - first]) {
+                        std::cout << " " << f;
+                    }
+                    std::cout << std::endl;
+                }
+            }
+            return 0;
         }
+
+        // 音声データを読み込み、MFCCを計算して、入力順に書き出す
+        wav::pipeline pipe(cfg, lanes, depth);
+        pipe.run(files, [&](const wav::job &j) {
+            if (!j.error.empty()) {
+                std::cerr << colorant('y', format_str("error: %s", j.error.c_str())) << std::endl;
+                return;
+            }
+            if (files.size() > 1) {
+                std::cout << "# " << j.fn << std::endl;
+            }
+            for (auto f : j.mfcc) {
+                std::cout << f << std::endl;
+            }
+        });
     } catch (const std::exception &e) {
         std::cerr << colorant('y', format_str("error: %s", e.what())) << std::endl;
     }
 }
-
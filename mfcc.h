@@ -0,0 +1,85 @@
+/********************************************************************************
+ *
+ * libmfcc C API
+ *
+ * a plan is created once from a config and is immutable afterwards, so one plan
+ * can be shared by any number of threads. samples are read directly from the
+ * caller's buffer and features are written into caller-provided memory.
+ *
+ * mfcc_config starts with its own size. new fields are only ever appended, and
+ * fields past the size the caller was compiled with take their default values,
+ * so a binary built against an older header keeps working with a newer library.
+ * only the mfcc_* functions are exported from the shared library.
+ *
+ * @example
+ * mfcc_config cfg;
+ * mfcc_config_default(&cfg);
+ * mfcc_plan *plan = mfcc_plan_create(&cfg);
+ * size_t frames = mfcc_frame_count(plan, n);
+ * float *out = malloc(frames * mfcc_plan_dim(plan) * sizeof(float));
+ * if (mfcc_compute_s16(plan, pcm, n, out, frames) != MFCC_OK) puts(mfcc_last_error());
+ * mfcc_plan_destroy(plan);
+ *
+ ********************************************************************************/
+#ifndef MFCC_H
+#define MFCC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MFCC_OK        0
+#define MFCC_EINVAL   -1 /* invalid argument */
+#define MFCC_ESPACE   -2 /* output buffer too small */
+#define MFCC_EINTERNAL -3
+
+#if defined(__GNUC__)
+#define MFCC_API __attribute__((visibility("default")))
+#else
+#define MFCC_API
+#endif
+
+typedef struct mfcc_config {
+    size_t size;     /* sizeof(mfcc_config) the caller was compiled with (set by mfcc_config_default) */
+    int    frame;    /* frame length (samples) */
+    int    hop;      /* frame shift (samples) */
+    int    fft;      /* number of fourier transform points */
+    int    channel;  /* mel filter bank channels */
+    int    mfcc_dim; /* number of coefficients per frame */
+    float  fmin;     /* lower edge of the mel filter bank (Hz) */
+    float  fmax;     /* upper edge (Hz), 0 for the nyquist frequency */
+    int    rate;     /* sample rate (Hz) of the input, required when fmin or fmax is set */
+} mfcc_config;
+
+typedef struct mfcc_plan mfcc_plan;
+
+/* fills the first `size` bytes of cfg with defaults and sets cfg->size */
+MFCC_API void        mfcc_config_init(mfcc_config *cfg, size_t size);
+#define mfcc_config_default(cfg) mfcc_config_init((cfg), sizeof(*(cfg)))
+
+/* returns NULL on error (see mfcc_last_error) */
+MFCC_API mfcc_plan  *mfcc_plan_create(const mfcc_config *cfg);
+MFCC_API void        mfcc_plan_destroy(mfcc_plan *plan);
+
+MFCC_API int         mfcc_plan_dim(const mfcc_plan *plan);
+MFCC_API size_t      mfcc_frame_count(const mfcc_plan *plan, size_t samples);
+
+/*
+ * compute features of every frame of samples[0..n) into out (frames x dim, row major).
+ * float samples are expected in -1.0 ~ 1.0, int16 samples are normalized by 2^15.
+ * out_frames is the capacity of out in frames.
+ */
+MFCC_API int         mfcc_compute_f32(const mfcc_plan *plan, const float *samples, size_t n, float *out, size_t out_frames);
+MFCC_API int         mfcc_compute_s16(const mfcc_plan *plan, const int16_t *samples, size_t n, float *out, size_t out_frames);
+
+/* message of the last error on the calling thread */
+MFCC_API const char *mfcc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MFCC_H */
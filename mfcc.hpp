@@ -0,0 +1,2054 @@
+#pragma once
+
+#include "./util.hpp"
+
+namespace wav {
+using namespace cc;
+
+typedef struct {
+    char           riff_id[4];   // "riff"
+    unsigned int   size;         // filesize - 8
+    char           wav_id[4];    // "WAVE"
+    char           fmt_id[4];    // "fmt "
+    unsigned int   fmt_size;     // fmtチャンクのバイト数
+    unsigned short format;       // フォーマット
+    unsigned short channels;     // チャンネル数
+    unsigned int   sample_rate;  // サンプリングレート
+    unsigned int   byte_per_sec; // データ速度
+    unsigned short block_size;   // ブロックサイズ
+    unsigned short bit;          // 量子化ビット数
+    char           data_id[4];   // "data"
+    unsigned int   data_size;    // 波形データのバイト数
+} header;
+
+/**
+ * ref : https://gist.github.com/yomakkkk/2290842
+ */
+inline void load(std::string fn, std::vector<char> &bytes) {
+    std::ifstream ifs(fn, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        throw std::runtime_error(format_str("failed to open %s", fn.c_str()));
+    }
+
+    // reuse the capacity of recycled buffers
+    bytes.resize((size_t)ifs.tellg());
+    ifs.seekg(0, std::ios::beg);
+    ifs.read(bytes.data(), bytes.size());
+    ifs.close();
+}
+
+inline void decode(const std::vector<char> &bytes, vec_t &data) {
+    wav::header header;
+    if (bytes.size() < sizeof(header)) {
+        throw std::runtime_error("failed to decode: header truncated");
+    }
+    memcpy(&header, bytes.data(), sizeof(header));
+
+    const size_t n     = (bytes.size() - sizeof(header)) / sizeof(short);
+    const float  scale = 1.0f / pow(2.0f, header.bit - 1); // normalize to -1.0 ~ 1.0
+
+    data.resize(n);
+    const char *p = bytes.data() + sizeof(header);
+    for (size_t i = 0; i < n; i++) {
+        short buf;
+        memcpy(&buf, p + i * sizeof(short), sizeof(buf));
+        data[i] = (float)buf * scale;
+    }
+}
+
+inline void read(std::string fn, vec_t &data) {
+    std::vector<char> bytes;
+    load(fn, bytes);
+    decode(bytes, data);
+}
+
+// void write(std::string fn, std::vector<short> &data, header &header) {
+//     std::ofstream ofs(fn, std::ios::out | std::ios::binary | std::ios::trunc);
+//     if (!ofs) {
+//         throw std::runtime_error(format_str("failed to write %s", fn));
+//     }
+//
+//     header.data_size = data.size();
+//     ofs.write((char *)&header, sizeof(header));
+//
+//     auto it = data.begin();
+//     while (it != data.end()) {
+//         short buf = *(it++);
+//         ofs.write((char *)&buf, sizeof(buf));
+//     }
+//     ofs.close();
+// }
+
+inline void pre_emphasis(vec_t &r) {
+    vec_t tmp(r.size());
+
+    tmp[0] = r[0];
+
+    // ignore first element
+    for (size_t i = 1; i < r.size(); i++) {
+        tmp[i] = r[i] - 0.97 * r[i - 1];
+    }
+
+    std::copy(tmp.begin(), tmp.end(), r.begin());
+}
+
+inline void window_hanning(vec_t &r) {
+    size_t N = r.size();
+
+    // apply hanning window
+    for (size_t i = 0; i < N; i++) {
+        r[i] *= (0.5 - 0.5 * cos(2 * M_PI * i / (N - 1)));
+    }
+}
+
+/**
+ * FREQ 点のフーリエ変換のうち、ビン [lo, hi) だけを計算する (それ以外には触らない)
+ * re, im は hi 以上の長さがあればよい
+ */
+inline void fourier(const vec_t &raw, int FREQ, int lo, int hi, vec_t &re, vec_t &im) {
+    int N = raw.size();
+
+    std::fill(re.begin() + lo, re.begin() + hi, 0.0f);
+    std::fill(im.begin() + lo, im.begin() + hi, 0.0f);
+
+    // apply fourier transform
+    for (int i = lo; i < hi; i++) {
+        for (int k = 0; k < N; k++) {
+            re[i] += (float)raw[k]  * cos(2.0f * M_PI * k * i / FREQ);
+            im[i] += (float)-raw[k] * sin(2.0f * M_PI * k * i / FREQ);
+        }
+    }
+}
+
+inline void fourier(const vec_t &raw, vec_t &re, vec_t &im) {
+    fourier(raw, re.size(), 0, re.size(), re, im);
+}
+
+/********************************************************************************
+ *
+ * fft_plan
+ *
+ * mixed-radix complex FFT (recursive decimation in time, forward direction) for any
+ * length. the length is factored in the given radix order first, and whatever is
+ * left is handled by a generic O(p^2) butterfly (e.g. 11 for 44000 = 4*4*2*5*5*5*11).
+ * a plan is immutable after construction and can be shared between threads.
+ *
+ ********************************************************************************/
+typedef std::complex<float> cpx;
+
+/**
+ * 因数分解で優先する基数の順番
+ */
+inline std::vector<int> radix_order(int order) {
+    switch (order) {
+        case 1: return {2, 3, 5};
+        case 2: return {5, 4, 3, 2};
+        default: return {4, 2, 3, 5};
+    }
+}
+
+class fft_plan {
+public:
+    fft_plan(int n, const std::vector<int> &radices) : n_(n), tw_(n) {
+        if (n <= 0) {
+            throw std::runtime_error("failed to plan fft: size must be positive");
+        }
+        for (int k = 0; k < n; k++) {
+            const double a = -2.0 * M_PI * k / n;
+            tw_[k] = cpx((float)std::cos(a), (float)std::sin(a));
+        }
+
+        int m = n;
+        for (int p : factorize(n, radices)) {
+            m /= p;
+            factors_.push_back(p);
+            factors_.push_back(m);
+        }
+    }
+
+    /**
+     * n を基数に分解する (radices の順に取り、残りは素因数)
+     */
+    static std::vector<int> factorize(int n, const std::vector<int> &radices) {
+        std::vector<int> ps;
+        int              rest = n;
+        for (int p : radices) {
+            while (p > 1 && rest % p == 0) {
+                ps.push_back(p);
+                rest /= p;
+            }
+        }
+        for (int p = 2; rest > 1; p++) {
+            while (rest % p == 0) {
+                ps.push_back(p);
+                rest /= p;
+            }
+        }
+        return ps;
+    }
+
+    /**
+     * n 点の変換の大まかな演算量 (汎用のバタフライは基数2,4の専用のものより1点あたり2倍ほど遅い)
+     */
+    static double cost(int n, const std::vector<int> &radices) {
+        double per_point = 0.0;
+        for (int p : factorize(n, radices)) {
+            per_point += p == 2 ? 1.0 : p == 4 ? 2.0 : 2.0 * p;
+        }
+        return per_point * n;
+    }
+
+    int size() const {return n_; }
+
+    void forward(const cpx *in, cpx *out) const {
+        if (factors_.empty()) {
+            out[0] = in[0];
+            return;
+        }
+        work(out, in, 1, factors_.data());
+    }
+
+private:
+    void work(cpx *out, const cpx *in, size_t fstride, const int *factors) const {
+        const int  p   = factors[0];
+        const int  m   = factors[1];
+        cpx       *beg = out;
+        cpx *const end = out + p * m;
+
+        if (m == 1) {
+            do {
+                *out = *in;
+                in  += fstride;
+            } while (++out != end);
+        } else {
+            do {
+                work(out, in, fstride * p, factors + 2);
+                in += fstride;
+            } while ((out += m) != end);
+        }
+
+        switch (p) {
+            case 2: butterfly2(beg, fstride, m);
+                break;
+            case 4: butterfly4(beg, fstride, m);
+                break;
+            default: butterfly(beg, fstride, m, p);
+                break;
+        }
+    }
+
+    void butterfly2(cpx *f, size_t fstride, int m) const {
+        cpx *f2 = f + m;
+        for (int k = 0; k < m; k++) {
+            const cpx t = f2[k] * tw_[k * fstride];
+            f2[k] = f[k] - t;
+            f[k] += t;
+        }
+    }
+
+    void butterfly4(cpx *f, size_t fstride, int m) const {
+        for (int k = 0; k < m; k++) {
+            const cpx s0 = f[k + m] * tw_[k * fstride];
+            const cpx s1 = f[k + 2 * m] * tw_[2 * k * fstride];
+            const cpx s2 = f[k + 3 * m] * tw_[3 * k * fstride];
+            const cpx s5 = f[k] - s1;
+            const cpx s3 = s0 + s2;
+            const cpx s4 = s0 - s2;
+            f[k]        += s1;
+            f[k + 2 * m] = f[k] - s3;
+            f[k]        += s3;
+            f[k + m]     = cpx(s5.real() + s4.imag(), s5.imag() - s4.real());
+            f[k + 3 * m] = cpx(s5.real() - s4.imag(), s5.imag() + s4.real());
+        }
+    }
+
+    void butterfly(cpx *f, size_t fstride, int m, int p) const {
+        cpx              fixed[32];
+        std::vector<cpx> dynamic(p > 32 ? p : 0);
+        cpx             *scratch = p > 32 ? dynamic.data() : fixed;
+
+        for (int u = 0; u < m; u++) {
+            for (int q = 0, k = u; q < p; q++, k += m) {
+                scratch[q] = f[k];
+            }
+            for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+                size_t idx = 0;
+                cpx    sum = scratch[0];
+                for (int q = 1; q < p; q++) {
+                    idx += fstride * k;
+                    if (idx >= (size_t)n_) idx %= n_;
+                    sum += scratch[q] * tw_[idx];
+                }
+                f[k] = sum;
+            }
+        }
+    }
+
+    int              n_;
+    std::vector<cpx> tw_;      // e^{-2 pi i k / n}
+    std::vector<int> factors_; // (radix, remaining length) pairs
+};
+
+/********************************************************************************
+ *
+ * rfft_plan
+ *
+ * fourier transform of real input returning only bins 0 .. n/2.
+ *
+ * forward(): the n real samples are packed as n/2 complex values
+ *   z[m] = x[2m] + j x[2m+1], transformed with an n/2-point FFT and split into
+ *   the spectra of the even and odd samples, X[k] = E[k] + e^{-2 pi i k / n} O[k].
+ * forward2(): two real frames are packed as z = x + j y into one n-point FFT and
+ *   separated with X[k] = (Z[k] + Z*[n-k]) / 2, Y[k] = (Z[k] - Z*[n-k]) / 2j.
+ *
+ * inputs shorter than n are zero padded. only bins [lo, hi) are written.
+ *
+ ********************************************************************************/
+class rfft_plan {
+public:
+    rfft_plan(int n, const std::vector<int> &radices) : n_(n), half_(n / 2, radices), full_(n, radices), w_(n / 2 + 1) {
+        if (n < 2 || n % 2) {
+            throw std::runtime_error("failed to plan real fft: size must be even");
+        }
+        for (int k = 0; k <= n / 2; k++) {
+            const double a = -2.0 * M_PI * k / n;
+            w_[k] = cpx((float)std::cos(a), (float)std::sin(a));
+        }
+    }
+
+    /**
+     * n, 基数の順番ごとに作ったプランを共有する
+     */
+    static std::shared_ptr<const rfft_plan> get(int n, int order) {
+        static std::mutex mutex;
+        static std::map<std::pair<int, int>, std::shared_ptr<const rfft_plan>> cache;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &plan = cache[std::make_pair(n, order)];
+        if (!plan) {
+            plan = std::make_shared<const rfft_plan>(n, radix_order(order));
+        }
+        return plan;
+    }
+
+    int size() const {return n_; }
+
+    void forward(const float *x, size_t len, int lo, int hi, float *re, float *im,
+                 std::vector<cpx> &z, std::vector<cpx> &Z) const {
+        const int h = n_ / 2;
+        len = std::min(len, (size_t)n_);
+
+        z.assign(h, cpx(0.0f, 0.0f));
+        for (size_t i = 0; i + 1 < len; i += 2) {
+            z[i / 2] = cpx(x[i], x[i + 1]);
+        }
+        if (len % 2) {
+            z[len / 2] = cpx(x[len - 1], 0.0f);
+        }
+        Z.resize(h);
+        half_.forward(z.data(), Z.data());
+
+        for (int k = lo; k < hi; k++) {
+            const cpx zk = Z[k % h];
+            const cpx zc = std::conj(Z[(h - k % h) % h]);
+            const cpx e  = 0.5f * (zk + zc);
+            const cpx d  = zk - zc;
+            const cpx o  = cpx(0.5f * d.imag(), -0.5f * d.real()); // d / 2j
+            const cpx X  = e + w_[k] * o;
+            re[k] = X.real();
+            im[k] = X.imag();
+        }
+    }
+
+    void forward2(const float *x, const float *y, size_t len, int lo, int hi,
+                  float *re_x, float *im_x, float *re_y, float *im_y,
+                  std::vector<cpx> &z, std::vector<cpx> &Z) const {
+        len = std::min(len, (size_t)n_);
+
+        z.assign(n_, cpx(0.0f, 0.0f));
+        for (size_t i = 0; i < len; i++) {
+            z[i] = cpx(x[i], y[i]);
+        }
+        Z.resize(n_);
+        full_.forward(z.data(), Z.data());
+
+        for (int k = lo; k < hi; k++) {
+            const cpx zk = Z[k];
+            const cpx zc = std::conj(Z[(n_ - k) % n_]);
+            const cpx s  = zk + zc;
+            const cpx d  = zk - zc;
+            re_x[k] = 0.5f * s.real();
+            im_x[k] = 0.5f * s.imag();
+            re_y[k] = 0.5f * d.imag();
+            im_y[k] = -0.5f * d.real();
+        }
+    }
+
+private:
+    int              n_;
+    fft_plan         half_;
+    fft_plan         full_;
+    std::vector<cpx> w_; // e^{-2 pi i k / n}
+};
+
+/********************************************************************************
+ *
+ * czt_plan
+ *
+ * bins [lo, hi) of the n-point fourier transform of a frame of len samples, as a
+ * chirp-z transform (Bluestein). with W = e^{-2 pi i / n} and
+ * i k = (i^2 + m^2 - (m - i)^2) / 2 for k = lo + m,
+ *
+ *   X[lo + m] = W^{m^2 / 2} sum_i (x[i] W^{i lo + i^2 / 2}) W^{-(m - i)^2 / 2}
+ *
+ * which is a convolution of length len + (hi - lo) - 1, done with two FFTs of a
+ * power-of-two size L. the frame is much shorter than n (1024 samples zero padded
+ * to 44000 points), so for a narrow band L is far smaller than n / 2.
+ *
+ ********************************************************************************/
+class czt_plan {
+public:
+    czt_plan(int n, int len, int lo, int hi) : n_(n), len_(len), lo_(lo), hi_(hi), fft_(size_for(len, hi - lo), {4, 2}),
+                                                 pre_(len), post_(hi - lo), B_(fft_.size()) {
+        if (n <= 0 || len <= 0 || lo < 0 || hi < lo) {
+            throw std::runtime_error("failed to plan chirp-z transform: invalid size");
+        }
+        const int L = fft_.size();
+        for (int i = 0; i < len; i++) {
+            pre_[i] = chirp((int64_t)i * i + 2 * (int64_t)i * lo);
+        }
+        for (int m = 0; m < hi - lo; m++) {
+            post_[m] = chirp((int64_t)m * m) / (float)L; // 逆FFTの 1/L もここでかける
+        }
+
+        // b[j] = W^{-j^2 / 2} (j = -(len - 1) .. hi - lo - 1) を巡回させて置く
+        std::vector<cpx> b(L, cpx(0.0f, 0.0f));
+        for (int j = 0; j < hi - lo; j++) {
+            b[j] = std::conj(chirp((int64_t)j * j));
+        }
+        for (int j = 1; j < len; j++) {
+            b[L - j] = std::conj(chirp((int64_t)j * j));
+        }
+        fft_.forward(b.data(), B_.data());
+    }
+
+    /**
+     * n, フレーム長, 帯域ごとに作ったプランを共有する
+     */
+    static std::shared_ptr<const czt_plan> get(int n, int len, int lo, int hi) {
+        static std::mutex mutex;
+        static std::map<std::vector<int>, std::shared_ptr<const czt_plan>> cache;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &plan = cache[std::vector<int> {n, len, lo, hi}];
+        if (!plan) {
+            plan = std::make_shared<const czt_plan>(n, len, lo, hi);
+        }
+        return plan;
+    }
+
+    /**
+     * 変換に使うFFTの点数
+     */
+    static int size_for(int len, int bins) {
+        int L = 1;
+        while (L < len + bins - 1) L <<= 1;
+        return L;
+    }
+
+    bool matches(int n, int len, int lo, int hi) const {return n == n_ && len == len_ && lo == lo_ && hi == hi_; }
+
+    void forward(const float *x, size_t len, float *re, float *im, std::vector<cpx> &z, std::vector<cpx> &Z) const {
+        const int L = fft_.size();
+        len = std::min(len, (size_t)len_);
+
+        z.assign(L, cpx(0.0f, 0.0f));
+        for (size_t i = 0; i < len; i++) {
+            z[i] = x[i] * pre_[i];
+        }
+        Z.resize(L);
+        fft_.forward(z.data(), Z.data());
+
+        // 畳み込み: 逆FFTは共役をとって順方向のFFTで計算する
+        for (int k = 0; k < L; k++) {
+            Z[k] = std::conj(Z[k] * B_[k]);
+        }
+        fft_.forward(Z.data(), z.data());
+
+        for (int m = 0; m < hi_ - lo_; m++) {
+            const cpx X = std::conj(z[m]) * post_[m];
+            re[lo_ + m] = X.real();
+            im[lo_ + m] = X.imag();
+        }
+    }
+
+private:
+    // W^{e / 2} = e^{-pi i e / n} (e は 2n で割った余りにしてから角度にする)
+    cpx chirp(int64_t e) const {
+        const double a = -M_PI * (double)(e % (2 * (int64_t)n_)) / n_;
+        return cpx((float)std::cos(a), (float)std::sin(a));
+    }
+
+    int              n_, len_, lo_, hi_;
+    fft_plan         fft_;
+    std::vector<cpx> pre_;  // W^{i lo + i^2 / 2}
+    std::vector<cpx> post_; // W^{m^2 / 2} / L
+    std::vector<cpx> B_;    // FFT of the chirp b
+};
+
+inline void amplitude(const vec_t &re, const vec_t &im, int lo, int hi, vec_t &amp) {
+    for (int i = lo; i < hi; i++) {
+        amp[i] = sqrt(re[i] * re[i] + im[i] * im[i]);
+    }
+}
+
+inline void amplitude(const vec_t &re, const vec_t &im, vec_t &amp) {
+    amplitude(re, im, 0, re.size(), amp);
+}
+
+inline float hz2mel(float f) {
+    return 1127.01048 * std::log(f / 700.0 + 1.0);
+}
+
+inline float mel2hz(float m) {
+    return 700.0 * (std::exp(m / 1127.01048) - 1.0);
+}
+
+/**
+ * 帯域 [fmin, fmax) にメルフィルタバンクを並べて振幅スペクトルとの内積をとる
+ * 周波数はスペクトルのビン単位 (df = 1) で、各フィルタは自分の範囲のビンだけを読む
+ */
+inline void melfilter(vec_t &amp, float fmin, float fmax, vec_t &mel_x, vec_t &mel_y) {
+    int NYQ     = amp.size();
+    int channel = mel_y.size();
+
+    int   melmin = hz2mel(fmin);
+    int   melmax = hz2mel(fmax);
+    float df     = 1;
+    float dmel   =  (melmax - melmin) / (channel + 1);
+
+    vec_t            m_centers(channel);
+    vec_t            f_centers(channel);
+    std::vector<int> i_centers(channel);
+    for (int i = 0; i < channel; i++) {
+        m_centers[i] = melmin + (i + 1) * dmel;
+        f_centers[i] = mel2hz(m_centers[i]);
+        i_centers[i] = (int)(f_centers[i] / df);
+    }
+    mel_x = f_centers;
+
+    const int lo = std::max((int)(fmin / df), 0);
+    const int hi = std::min((int)(fmax / df), NYQ);
+
+    std::vector<int> i_s(channel);
+    std::vector<int> i_e(channel);
+    for (int i = 0; i < channel; i++) {
+        i_s[i] = (i - 1) == -1      ? lo : i_centers[i - 1];
+        i_e[i] = (i + 1) == channel ? hi : i_centers[i + 1];
+    }
+
+    for (int c = 0; c < channel; c++) {
+        float sum = 0.0f;
+
+        for (int i = i_s[c]; i < i_centers[c]; i++) {
+            float w = (1.0f / (i_centers[c] - i_s[c])) * (i - i_s[c]);
+            sum += amp[i] * w;
+        }
+
+        for (int i = i_centers[c]; i < i_e[c]; i++) {
+            float w = 1.0 - (1.0f / (i_e[c] - i_centers[c])) * (i - i_centers[c]);
+            sum += amp[i] * w;
+        }
+        mel_y[c] = sum;
+    }
+}
+
+inline void melfilter(vec_t &amp, vec_t &mel_x, vec_t &mel_y) {
+    melfilter(amp, 0.0f, amp.size(), mel_x, mel_y);
+}
+
+/**
+ * ref : http://tony-mooori.blogspot.jp/2016/02/dctpythonpython.html
+ */
+inline void dct(vec_t &s, vec_t &d) {
+    int N = s.size();
+
+    std::fill(d.begin(), d.end(), 0.0f);
+
+    for (int k = 0; k < N; k++) {
+        for (int i = 0; i < N; i++) {
+            if (k == 0) {
+                d[k] += s[i] * sqrt(1.0f / N);
+            } else {
+                d[k] += s[i] * sqrt(2.0f / N) * cos((2 * i + 1) * k * M_PI / 2.0f / N);
+            }
+        }
+    }
+}
+
+inline void idct(vec_t &s, vec_t &d) {
+    int N = s.size();
+
+    std::fill(d.begin(), d.end(), 0.0f);
+
+    for (int k = 0; k < N; k++) {
+        for (int i = 0; i < N; i++) {
+            if (k == 0) {
+                d[i] += s[k] * sqrt(1.0f / N);
+            } else {
+                d[i] += s[k] * sqrt(2.0f / N) * cos((2 * i + 1) * k * M_PI / 2.0f / N);
+            }
+        }
+    }
+}
+
+inline void log_spectrum(vec_t &a) {
+    int N = a.size();
+
+    for (int i = 0; i < N; i++) {
+        a[i] = 20.0f * log10f(a[i]);
+    }
+}
+
+/**
+ * 特徴量抽出の設定
+ */
+struct config {
+    int frame    = 1024;  // フレーム長 (サンプル数)
+    int hop      = 512;   // フレームシフト (サンプル数)
+    int fft      = 44000; // フーリエ変換の点数
+    int channel  = 20;    // メルフィルタバンクのチャンネル数
+    int mfcc_dim = 12;    // MFCCの次元数
+    float fmin   = 0.0f;  // メルフィルタバンクの下端 (Hz)
+    float fmax   = 0.0f;  // 同上端 (Hz, 0 ならナイキスト周波数)
+    int rate     = 0;     // サンプリング周波数 (Hz, fmin / fmax をビンに換算するのに使う)
+    int transform = 2;    // フーリエ変換の方式 (enum transform)
+    int radix    = 0;     // FFTで優先する基数の順番 (radix_order)
+    int tile     = 2;     // 1回のFFTにまとめるフレーム数 (1 or 2)
+    int anchor   = 8192;  // スライディングDFTを直接計算し直す間隔 (サンプル数)
+    int zoom     = -1;    // FFTで帯域を chirp-z 変換で求めるか (1: 使う, 0: 実数FFT, -1: 演算量の見積もりで決める)
+};
+
+/**
+ * フーリエ変換の方式
+ */
+enum transform {
+    TRANSFORM_DFT     = 0, // フレームごとに帯域内のビンを直接計算する
+    TRANSFORM_SLIDING = 1, // 1サンプルずつ再帰的に更新する (ホップが小さいとき向け)
+    TRANSFORM_FFT     = 2, // 実数入力のFFT (2フレームずつまとめて変換する)
+};
+
+/**
+ * メルフィルタバンクが読むスペクトルのビン範囲 [lo, hi) (fmin / fmax を fft / rate 倍してビンにする)
+ */
+inline void band(const config &cfg, int &lo, int &hi) {
+    const int NYQ = cfg.fft / 2;
+    if (cfg.fmin <= 0.0f && cfg.fmax <= 0.0f) {
+        lo = 0;
+        hi = NYQ;
+        return;
+    }
+    if (cfg.rate <= 0) {
+        throw std::runtime_error("fmin / fmax need the sample rate (config::rate)");
+    }
+    const double bins_per_hz = (double)cfg.fft / cfg.rate;
+    lo = (int)std::min(std::max(cfg.fmin * bins_per_hz, 0.0), (double)NYQ);
+    hi = cfg.fmax > 0.0f ? (int)std::min(std::ceil(cfg.fmax * bins_per_hz), (double)NYQ) : NYQ;
+    hi = std::max(hi, lo);
+}
+
+/**
+ * 設定にサンプリング周波数がなければ音声ファイルのものを入れる
+ */
+inline config with_rate(config cfg, int rate) {
+    if (cfg.rate <= 0) cfg.rate = rate;
+    return cfg;
+}
+
+/**
+ * 信号長 n サンプルに含まれるフレーム数 (短い信号はゼロ詰めした1フレームとみなす)
+ */
+inline size_t frame_count(size_t n, const config &cfg) {
+    if (n <= (size_t)cfg.frame) {
+        return 1;
+    }
+    return 1 + (n - cfg.frame) / cfg.hop;
+}
+
+/**
+ * 出力の種類 (ビットマスク)
+ */
+enum output : unsigned {
+    OUT_SPEC   = 1 << 0, // 振幅スペクトル (ナイキスト周波数まで)
+    OUT_FBANK  = 1 << 1, // 対数メルスペクトル
+    OUT_MFCC   = 1 << 2, // MFCC
+    OUT_ENERGY = 1 << 3, // フレームの対数パワー
+    OUT_ALL    = OUT_SPEC | OUT_FBANK | OUT_MFCC | OUT_ENERGY,
+};
+
+/**
+ * 1フレーム分の中間結果 (フレーム間で使い回す)
+ */
+struct frame_outputs {
+    vec_t re;
+    vec_t im;
+    vec_t amp;      // 振幅スペクトル
+    vec_t mel_x;
+    vec_t fbank;    // 対数メルスペクトル
+    vec_t cepstrum;
+    vec_t mfcc;
+    float energy;   // 対数パワー
+
+    // re, im, amp は帯域 [band_lo, band_hi) の外を 0 のまま使い回す
+    int band_lo = 0;
+    int band_hi = 0;
+
+    // FFTの作業領域 (プランは cfg.fft, cfg.radix, 帯域が変わったときだけ取り直す)
+    std::shared_ptr<const rfft_plan> plan;
+    int                              plan_radix = 0;
+    std::shared_ptr<const czt_plan>  zoom;
+    std::vector<cpx>                 z;
+    std::vector<cpx>                 Z;
+};
+
+/**
+ * re, im, amp を帯域 [lo, hi) 用に用意する (サイズか帯域が変わったときだけ 0 で埋め直す)
+ * 変換と from_spectrum は帯域の中しか書かないので、帯域外は 0 のまま残る
+ */
+inline void spectrum_for(const config &cfg, int lo, int hi, frame_outputs &out) {
+    const size_t NYQ = cfg.fft / 2;
+    if (out.re.size() != NYQ || out.im.size() != NYQ || out.amp.size() != NYQ || out.band_lo != lo || out.band_hi != hi) {
+        out.re.assign(NYQ, 0.0f);
+        out.im.assign(NYQ, 0.0f);
+        out.amp.assign(NYQ, 0.0f);
+        out.band_lo = lo;
+        out.band_hi = hi;
+    }
+}
+
+inline const rfft_plan &plan_for(const config &cfg, frame_outputs &out) {
+    if (!out.plan || out.plan->size() != cfg.fft || out.plan_radix != cfg.radix) {
+        out.plan       = rfft_plan::get(cfg.fft, cfg.radix);
+        out.plan_radix = cfg.radix;
+    }
+    return *out.plan;
+}
+
+inline const czt_plan &zoom_for(const config &cfg, int lo, int hi, frame_outputs &out) {
+    if (!out.zoom || !out.zoom->matches(cfg.fft, cfg.frame, lo, hi)) {
+        out.zoom = czt_plan::get(cfg.fft, cfg.frame, lo, hi);
+    }
+    return *out.zoom;
+}
+
+/**
+ * 帯域 [lo, hi) を chirp-z 変換で求めるか (cfg.zoom が -1 なら実数FFTより速いと見積もれるとき)
+ * (奇数点は実数FFTが使えないので常に chirp-z)
+ */
+inline bool use_zoom(const config &cfg, int lo, int hi) {
+    if (cfg.fft % 2) {
+        return true;
+    }
+    if (hi <= lo) {
+        return false;
+    }
+    if (cfg.zoom >= 0) {
+        return cfg.zoom != 0;
+    }
+    const double zoom = 2.0 * fft_plan::cost(czt_plan::size_for(cfg.frame, hi - lo), {4, 2});
+    const double full = fft_plan::cost(cfg.fft / 2, radix_order(cfg.radix));
+    return zoom < full;
+}
+
+/**
+ * フーリエ変換の結果 (out.re, out.im) から振幅スペクトル以降を計算する
+ * (spectrum_for で用意したバッファの帯域 [lo, hi) だけを読む)
+ */
+inline void from_spectrum(const config &cfg, frame_outputs &out) {
+    int lo, hi;
+    band(cfg, lo, hi);
+
+    // 振幅スペクトルにする (フィルタバンクが読む帯域だけ)
+    amplitude(out.re, out.im, lo, hi, out.amp);
+
+    // メルフィルタバンクと内積をとって次元を減らす
+    const int DIM = cfg.channel;
+    out.mel_x.resize(DIM);
+    out.fbank.resize(DIM);
+    melfilter(out.amp, lo, hi, out.mel_x, out.fbank);
+
+    // 対数スペクトルに変換する
+    log_spectrum(out.fbank);
+
+    // 離散コサイン変換 (DCT-II) でケプストラム領域に移す
+    out.cepstrum.resize(DIM);
+    dct(out.fbank, out.cepstrum);
+
+    // リフタリングで定常成分と高次成分を除去してMFCCを得る
+    const int MFCC_DIM = cfg.mfcc_dim;
+    out.mfcc.resize(MFCC_DIM);
+    std::copy(out.cepstrum.begin() + 1, out.cepstrum.begin() + MFCC_DIM + 1, out.mfcc.begin());
+}
+
+/**
+ * プリエンファシス済みの1フレームからすべての中間結果を計算する (frameは作業領域として書き換えられる)
+ */
+inline void prepare(vec_t &frame, const config &cfg, frame_outputs &out) {
+    // フレーム長にそろえる
+    frame.resize(cfg.frame);
+
+    // 窓をかける前のパワーを対数にする
+    double power = 0.0;
+    for (auto x : frame) {
+        power += (double)x * x;
+    }
+    out.energy = std::log(std::max(power, 1e-10));
+
+    // ハニング窓関数をかける
+    window_hanning(frame);
+}
+
+inline void analyze(vec_t &frame, const config &cfg, frame_outputs &out) {
+    prepare(frame, cfg, out);
+
+    // フィルタバンクが使う帯域のビンだけをフーリエ変換する
+    const int FRQ = cfg.fft;
+    int       lo, hi;
+    band(cfg, lo, hi);
+    spectrum_for(cfg, lo, hi, out);
+    if (cfg.transform == TRANSFORM_DFT) {
+        fourier(frame, FRQ, lo, hi, out.re, out.im);
+    } else if (use_zoom(cfg, lo, hi)) {
+        zoom_for(cfg, lo, hi, out).forward(frame.data(), frame.size(), out.re.data(), out.im.data(), out.z, out.Z);
+    } else {
+        plan_for(cfg, out).forward(frame.data(), frame.size(), lo, hi, out.re.data(), out.im.data(), out.z, out.Z);
+    }
+
+    from_spectrum(cfg, out);
+}
+
+/**
+ * 2フレームを1回の複素FFTでまとめて解析する
+ */
+inline void analyze(vec_t &frame_a, vec_t &frame_b, const config &cfg, frame_outputs &out_a, frame_outputs &out_b) {
+    int lo, hi;
+    band(cfg, lo, hi);
+    if (cfg.transform != TRANSFORM_FFT || cfg.tile < 2 || use_zoom(cfg, lo, hi)) {
+        analyze(frame_a, cfg, out_a);
+        analyze(frame_b, cfg, out_b);
+        return;
+    }
+
+    prepare(frame_a, cfg, out_a);
+    prepare(frame_b, cfg, out_b);
+
+    spectrum_for(cfg, lo, hi, out_a);
+    spectrum_for(cfg, lo, hi, out_b);
+    plan_for(cfg, out_a).forward2(frame_a.data(), frame_b.data(), cfg.frame, lo, hi,
+                                  out_a.re.data(), out_a.im.data(), out_b.re.data(), out_b.im.data(), out_a.z, out_a.Z);
+
+    from_spectrum(cfg, out_a);
+    from_spectrum(cfg, out_b);
+}
+
+/**
+ * プリエンファシス済みの1フレームからMFCCを計算する (frameは作業領域として書き換えられる)
+ */
+inline void features(vec_t &frame, const config &cfg, vec_t &mfcc) {
+    frame_outputs out;
+    analyze(frame, cfg, out);
+    mfcc.swap(out.mfcc);
+}
+
+/**
+ * 先頭1フレーム分のMFCCを計算する (rawは作業領域として書き換えられる)
+ */
+inline void mfcc(vec_t &raw, const config &cfg, vec_t &mfcc) {
+    // リサイズする
+    raw.resize(cfg.frame);
+
+    // プリエンファシスをかけて高音を強調する
+    pre_emphasis(raw);
+
+    features(raw, cfg, mfcc);
+}
+
+inline void mfcc(vec_t &raw, vec_t &mfcc) {
+    wav::mfcc(raw, config(), mfcc);
+}
+
+/**
+ * 呼び出し側のバッファ (正規化前のサンプル x[0..n)) からフレーム k を切り出し、
+ * scale をかけてプリエンファシスしたものを frame に入れる (信号全体のコピーを作らない)
+ */
+template<typename T>
+inline void frame_at(const T *x, size_t n, size_t k, float scale, const config &cfg, vec_t &frame) {
+    const size_t begin = k * cfg.hop;
+    const size_t end   = std::min(begin + cfg.frame, n);
+
+    frame.assign(cfg.frame, 0.0f);
+    for (size_t i = begin; i < end; i++) {
+        const float cur = (float)x[i] * scale;
+        if (i == 0) {
+            frame[0] = cur;
+        } else {
+            const float prev = (float)x[i - 1] * scale;
+            frame[i - begin] = (float)(cur - 0.97 * prev);
+        }
+    }
+}
+
+/********************************************************************************
+ *
+ * sliding_dft
+ *
+ * keeps the hanning-windowed spectrum of a frame up to date one sample at a time.
+ *
+ * with U(p) = sum_n x[s + n] e^{-j p n} over the frame, moving the frame by one
+ * sample is U(p) <- e^{j p} (U(p) - x[s] + x[s + N] e^{-j p N}), O(1) per bin.
+ * the hanning window 0.5 - 0.5 cos(t n), t = 2 pi / (N - 1), is applied in the
+ * frequency domain as X(w) = 0.5 U(w) - 0.25 U(w - t) - 0.25 U(w + t), so three
+ * sums are kept per bin. the sums are recomputed directly every `anchor` samples
+ * to bound the drift of the recursion.
+ *
+ ********************************************************************************/
+class sliding_dft {
+public:
+    explicit sliding_dft(const config &cfg) : cfg_(cfg), since_anchor_(0), power_(0.0) {
+        band(cfg, lo_, hi_);
+        const size_t bins  = hi_ - lo_;
+        const double theta = 2.0 * M_PI / (cfg.frame - 1);
+        const double N     = cfg.frame;
+
+        phi_.resize(3 * bins);
+        for (size_t b = 0; b < bins; b++) {
+            const double w = 2.0 * M_PI * (lo_ + b) / cfg.fft;
+            phi_[3 * b + 0] = w;
+            phi_[3 * b + 1] = w - theta;
+            phi_[3 * b + 2] = w + theta;
+        }
+
+        rot_re_.resize(phi_.size());
+        rot_im_.resize(phi_.size());
+        tail_re_.resize(phi_.size());
+        tail_im_.resize(phi_.size());
+        u_re_.assign(phi_.size(), 0.0);
+        u_im_.assign(phi_.size(), 0.0);
+        for (size_t i = 0; i < phi_.size(); i++) {
+            rot_re_[i]  = std::cos(phi_[i]);
+            rot_im_[i]  = std::sin(phi_[i]);
+            tail_re_[i] = std::cos(phi_[i] * N);
+            tail_im_[i] = -std::sin(phi_[i] * N);
+        }
+    }
+
+    /**
+     * x[0..frame) を先頭とするフレームで状態を直接計算し直す
+     */
+    void reset(const float *x) {
+        const int N = cfg_.frame;
+        for (size_t i = 0; i < phi_.size(); i++) {
+            // e^{-j p n} を回転で進める
+            const double cr = rot_re_[i], ci = -rot_im_[i];
+            double       pr = 1.0, pi = 0.0, sr = 0.0, si = 0.0;
+            for (int n = 0; n < N; n++) {
+                sr += x[n] * pr;
+                si += x[n] * pi;
+                const double t = pr * cr - pi * ci;
+                pi = pr * ci + pi * cr;
+                pr = t;
+            }
+            u_re_[i] = sr;
+            u_im_[i] = si;
+        }
+
+        power_ = 0.0;
+        for (int n = 0; n < N; n++) {
+            power_ += (double)x[n] * x[n];
+        }
+        since_anchor_ = 0;
+    }
+
+    /**
+     * フレームを1サンプル進める (x_old が抜けて x_new が入る)
+     */
+    void slide(float x_old, float x_new) {
+        for (size_t i = 0; i < phi_.size(); i++) {
+            const double ar = u_re_[i] - x_old + x_new * tail_re_[i];
+            const double ai = u_im_[i] + x_new * tail_im_[i];
+            u_re_[i] = ar * rot_re_[i] - ai * rot_im_[i];
+            u_im_[i] = ar * rot_im_[i] + ai * rot_re_[i];
+        }
+        power_ += (double)x_new * x_new - (double)x_old * x_old;
+        since_anchor_++;
+    }
+
+    bool needs_anchor() const {return since_anchor_ >= (size_t)cfg_.anchor; }
+
+    /**
+     * 窓をかけたスペクトル (帯域外は 0) と窓をかける前のパワーを返す
+     */
+    void spectrum(frame_outputs &out) const {
+        spectrum_for(cfg_, lo_, hi_, out);
+        for (int k = lo_; k < hi_; k++) {
+            const size_t i = 3 * (k - lo_);
+            out.re[k] = (float)(0.5 * u_re_[i] - 0.25 * (u_re_[i + 1] + u_re_[i + 2]));
+            out.im[k] = (float)(0.5 * u_im_[i] - 0.25 * (u_im_[i + 1] + u_im_[i + 2]));
+        }
+        out.energy = std::log(std::max(power_, 1e-10));
+    }
+
+private:
+    config              cfg_;
+    int                 lo_, hi_;
+    size_t              since_anchor_;
+    double              power_;
+    std::vector<double> phi_;
+    std::vector<double> rot_re_, rot_im_;   // e^{j p}
+    std::vector<double> tail_re_, tail_im_; // e^{-j p N}
+    std::vector<double> u_re_, u_im_;
+};
+
+/**
+ * スライディングDFTでフレーム [first, last) を解析する (signal[0] がフレーム first の先頭)
+ */
+inline void extract_sliding(const vec_t &signal, size_t first, size_t last, const config &cfg,
+                            const std::function<void(size_t, const frame_outputs &)> &emit) {
+    if (first >= last) {
+        return;
+    }
+
+    // 信号の終わりより先はゼロとみなす
+    const size_t  span = (last - 1 - first) * cfg.hop + cfg.frame;
+    vec_t         x(std::max(span, signal.size()), 0.0f);
+    std::copy(signal.begin(), signal.end(), x.begin());
+
+    sliding_dft   sdft(cfg);
+    frame_outputs out;
+    sdft.reset(&x[0]);
+    for (size_t k = first; k < last; k++) {
+        const size_t begin = (k - first) * cfg.hop;
+        if (k > first) {
+            if (sdft.needs_anchor() || cfg.hop >= cfg.frame) {
+                sdft.reset(&x[begin]);
+            } else {
+                for (size_t s = begin - cfg.hop; s < begin; s++) {
+                    sdft.slide(x[s], x[s + cfg.frame]);
+                }
+            }
+        }
+        sdft.spectrum(out);
+        from_spectrum(cfg, out);
+        emit(k, out);
+    }
+}
+
+/**
+ * プリエンファシス済みの信号からフレーム [first, last) を1回ずつ解析し、中間結果をコールバックに渡す
+ * signal[0] がフレーム first の先頭サンプルに対応する
+ */
+inline void extract(const vec_t &signal, size_t first, size_t last, const config &cfg,
+             const std::function<void(size_t, const frame_outputs &)> &emit) {
+    if (cfg.transform == TRANSFORM_SLIDING) {
+        extract_sliding(signal, first, last, cfg, emit);
+        return;
+    }
+
+    auto cut = [&](size_t k, vec_t &frame) {
+        const size_t begin = (k - first) * cfg.hop;
+        const size_t end   = std::min(begin + cfg.frame, signal.size());
+
+        frame.assign(cfg.frame, 0.0f);
+        if (begin < end) {
+            std::copy(signal.begin() + begin, signal.begin() + end, frame.begin());
+        }
+    };
+
+    // 2フレームずつまとめて変換する
+    frame_outputs out_a, out_b;
+    vec_t         frame_a(cfg.frame), frame_b(cfg.frame);
+    size_t        k = first;
+    for (; k + 1 < last; k += 2) {
+        cut(k, frame_a);
+        cut(k + 1, frame_b);
+        analyze(frame_a, frame_b, cfg, out_a, out_b);
+        emit(k, out_a);
+        emit(k + 1, out_b);
+    }
+    if (k < last) {
+        cut(k, frame_a);
+        analyze(frame_a, cfg, out_a);
+        emit(k, out_a);
+    }
+}
+
+inline void extract(const vec_t &signal, size_t first, size_t last, const config &cfg, std::vector<vec_t> &feats) {
+    feats.resize(last - first);
+    extract(signal, first, last, cfg, [&](size_t k, const frame_outputs &out) {
+        feats[k - first] = out.mfcc;
+    });
+}
+
+/********************************************************************************
+ *
+ * pipeline
+ *
+ * reader -> decoder -> compute lanes -> writer
+ *
+ * stages are connected by spsc_queue so that disk reads of the next files overlap
+ * with the computation of the current ones. jobs (and the buffers they own) are
+ * preallocated and recycled through a free ring from the writer back to the reader.
+ * compute lanes are fed round-robin, and the writer drains them in the same order,
+ * so results come out in input order.
+ *
+ * by default a lane computes the MFCC of the first frame only (job::mfcc). with
+ * all_frames every frame of the file is extracted into job::frames, as segment()
+ * does for the whole file.
+ *
+ ********************************************************************************/
+struct job {
+    size_t             id;
+    std::string        fn;
+    std::vector<char>  bytes;
+    vec_t              raw;
+    vec_t              mfcc;
+    std::vector<vec_t> frames; // all_frames のときの全フレームのMFCC
+    int                rate;   // ヘッダのサンプリング周波数
+    std::string        error;
+};
+
+class pipeline {
+public:
+    pipeline(const config &cfg, size_t lanes, size_t depth, bool all_frames = false)
+        : cfg_(cfg), lanes_(std::max<size_t>(lanes, 1)), depth_(std::max(depth, lanes_ + 1)), all_frames_(all_frames) {}
+
+    void run(const std::vector<std::string> &files, const std::function<void(const job &)> &sink) {
+        const size_t n = files.size();
+
+        std::vector<job> pool(depth_);
+        spsc_queue<job *> free_q(depth_);
+        spsc_queue<job *> read_q(depth_);
+        std::vector<std::unique_ptr<spsc_queue<job *>>> in_q, out_q;
+        for (size_t l = 0; l < lanes_; l++) {
+            in_q.emplace_back(new spsc_queue<job *>(depth_));
+            out_q.emplace_back(new spsc_queue<job *>(depth_));
+        }
+        for (auto &j : pool) {
+            free_q.push(&j);
+        }
+
+        // reader: runs ahead of the decoder by up to `depth` files
+        std::thread reader([&] {
+            for (size_t i = 0; i < n; i++) {
+                job *j = free_q.pop();
+                j->id = i;
+                j->fn = files[i];
+                j->error.clear();
+                try {
+                    load(j->fn, j->bytes);
+                } catch (const std::exception &e) {
+                    j->error = e.what();
+                }
+                read_q.push(j);
+            }
+        });
+
+        // decoder: pcm bytes -> normalized samples
+        std::thread decoder([&] {
+            for (size_t i = 0; i < n; i++) {
+                job *j = read_q.pop();
+                if (j->error.empty()) {
+                    try {
+                        decode(j->bytes, j->raw);
+                        wav::header h;
+                        memcpy(&h, j->bytes.data(), sizeof(h));
+                        j->rate = h.sample_rate;
+                    } catch (const std::exception &e) {
+                        j->error = e.what();
+                    }
+                }
+                in_q[j->id % lanes_]->push(j);
+            }
+            for (size_t l = 0; l < lanes_; l++) {
+                in_q[l]->push(nullptr);
+            }
+        });
+
+        // compute lanes: samples -> features
+        std::vector<std::thread> workers;
+        for (size_t l = 0; l < lanes_; l++) {
+            workers.emplace_back([&, l] {
+                for (job *j; (j = in_q[l]->pop()) != nullptr;) {
+                    if (j->error.empty()) {
+                        try {
+                            const config cfg = with_rate(cfg_, j->rate);
+                            if (all_frames_) {
+                                // 短い信号は segment() と同じく1フレーム分までゼロ詰めしてからプリエンファシスをかける
+                                j->raw.resize(std::max(j->raw.size(), (size_t)cfg.frame));
+                                pre_emphasis(j->raw);
+                                extract(j->raw, 0, frame_count(j->raw.size(), cfg), cfg, j->frames);
+                            } else {
+                                mfcc(j->raw, cfg, j->mfcc);
+                            }
+                        } catch (const std::exception &e) {
+                            j->error = e.what();
+                        }
+                    }
+                    out_q[l]->push(j);
+                }
+            });
+        }
+
+        // writer: runs on the calling thread and returns buffers to the pool
+        for (size_t i = 0; i < n; i++) {
+            job *j = out_q[i % lanes_]->pop();
+            sink(*j);
+            free_q.push(j);
+        }
+
+        reader.join();
+        decoder.join();
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+private:
+    config cfg_;
+    size_t lanes_;
+    size_t depth_;
+    bool   all_frames_;
+};
+
+/********************************************************************************
+ *
+ * segment
+ *
+ * seek into the data chunk and compute only the frames whose start lies in [t0, t1).
+ * one extra sample before the first frame is read so that pre-emphasis gives the
+ * same values as when the whole file is processed.
+ *
+ ********************************************************************************/
+struct source {
+    std::string fn;
+    wav::header header;
+    size_t      samples; // number of samples in the data chunk
+};
+
+inline void open(std::string fn, source &src) {
+    std::ifstream ifs(fn, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        throw std::runtime_error(format_str("failed to open %s", fn.c_str()));
+    }
+
+    const size_t size = (size_t)ifs.tellg();
+    if (size < sizeof(src.header)) {
+        throw std::runtime_error(format_str("failed to decode %s: header truncated", fn.c_str()));
+    }
+    ifs.seekg(0, std::ios::beg);
+    ifs.read((char *)&src.header, sizeof(src.header));
+
+    src.fn      = fn;
+    src.samples = (size - sizeof(src.header)) / sizeof(short);
+}
+
+/**
+ * サンプル [begin, begin + count) を読み込む (範囲外はゼロ)
+ */
+inline void read(const source &src, size_t begin, size_t count, vec_t &data) {
+    data.assign(count, 0.0f);
+    if (begin >= src.samples) {
+        return;
+    }
+    const size_t n = std::min(count, src.samples - begin);
+
+    std::ifstream ifs(src.fn, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        throw std::runtime_error(format_str("failed to open %s", src.fn.c_str()));
+    }
+    ifs.seekg(sizeof(src.header) + begin * sizeof(short), std::ios::beg);
+
+    std::vector<short> buf(n);
+    ifs.read((char *)buf.data(), n * sizeof(short));
+
+    const float scale = 1.0f / pow(2.0f, src.header.bit - 1);
+    for (size_t i = 0; i < n; i++) {
+        data[i] = (float)buf[i] * scale;
+    }
+}
+
+/**
+ * 時刻 [t0, t1) (秒) を開始時刻に含むフレームの範囲 [first, last) を求める
+ */
+inline void frame_range(const source &src, double t0, double t1, const config &cfg, size_t &first, size_t &last) {
+    const size_t total = frame_count(src.samples, cfg);
+    const double rate  = src.header.sample_rate;
+
+    // size_t に変換する前に double のまま total で抑える (t1 が無限大や DBL_MAX でも範囲外の変換にならない)
+    auto to_frame = [&](double t) {
+        const double k = std::ceil(std::max(t, 0.0) * rate / cfg.hop);
+        return k < (double)total ? (size_t)k : total;
+    };
+    first = to_frame(t0);
+    last  = std::max(to_frame(t1), first);
+}
+
+inline void segment(const source &src, size_t first, size_t last, const config &cfg,
+             const std::function<void(size_t, const frame_outputs &)> &emit) {
+    if (first >= last) {
+        return;
+    }
+
+    // 直前の1サンプルをプリエンファシスのウォームアップに使う
+    const size_t warmup = first > 0 ? 1 : 0;
+    const size_t begin  = first * cfg.hop - warmup;
+    const size_t count  = (last - 1 - first) * cfg.hop + cfg.frame + warmup;
+
+    vec_t signal;
+    read(src, begin, count, signal);
+    pre_emphasis(signal);
+    signal.erase(signal.begin(), signal.begin() + warmup);
+
+    extract(signal, first, last, with_rate(cfg, src.header.sample_rate), emit);
+}
+
+inline void segment(const source &src, size_t first, size_t last, const config &cfg, std::vector<vec_t> &feats) {
+    feats.resize(last > first ? last - first : 0);
+    segment(src, first, last, cfg, [&](size_t k, const frame_outputs &out) {
+        feats[k - first] = out.mfcc;
+    });
+}
+
+/********************************************************************************
+ *
+ * frame_index
+ *
+ * sidecar file (<wav>.idx) holding precomputed features of every frame, so that
+ * the features of frame k are found at a fixed offset without touching the audio.
+ *
+ ********************************************************************************/
+class frame_index {
+public:
+    struct header {
+        char     magic[4];    // "MFIX"
+        uint32_t version;
+        uint32_t frame;
+        uint32_t hop;
+        uint32_t fft;
+        uint32_t channel;
+        uint32_t mfcc_dim;
+        uint32_t sample_rate; // 帯域の計算に使ったサンプルレート (config::rate があればそれ)
+        float    fmin;
+        float    fmax;
+        uint64_t frames;
+    };
+
+    static std::string path(const std::string &fn) {return fn + ".idx"; }
+
+    static void build(const source &src, const config &cfg) {
+        const size_t       total = frame_count(src.samples, cfg);
+        std::vector<vec_t> feats;
+        segment(src, 0, total, cfg, feats);
+        build(src, cfg, feats);
+    }
+
+    /**
+     * 計算済みの全フレームの特徴量からインデックスを書く
+     */
+    static void build(const source &src, const config &cfg, const std::vector<vec_t> &feats) {
+        std::ofstream ofs(path(src.fn), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!ofs) {
+            throw std::runtime_error(format_str("failed to write %s", path(src.fn).c_str()));
+        }
+
+        header h = describe(src, cfg);
+        ofs.write((char *)&h, sizeof(h));
+        for (auto &f : feats) {
+            ofs.write((char *)f.data(), f.size() * sizeof(float));
+        }
+        ofs.close();
+    }
+
+    /**
+     * 設定が一致するインデックスがあれば開く
+     */
+    bool open(const source &src, const config &cfg) {
+        ifs_.close();
+        ifs_.clear();
+        ifs_.open(path(src.fn), std::ios::in | std::ios::binary);
+        if (!ifs_) {
+            return false;
+        }
+
+        header expected = describe(src, cfg);
+        ifs_.read((char *)&header_, sizeof(header_));
+        if (!ifs_ || memcmp(&header_, &expected, sizeof(header_)) != 0) {
+            ifs_.close();
+            return false;
+        }
+        return true;
+    }
+
+    void read(size_t first, size_t last, std::vector<vec_t> &feats) {
+        const size_t dim = header_.mfcc_dim;
+        last = std::min<size_t>(last, header_.frames);
+
+        feats.resize(last > first ? last - first : 0);
+        ifs_.clear();
+        ifs_.seekg(sizeof(header_) + first * dim * sizeof(float), std::ios::beg);
+        for (auto &f : feats) {
+            f.resize(dim);
+            ifs_.read((char *)f.data(), dim * sizeof(float));
+        }
+        if (!ifs_) {
+            throw std::runtime_error("failed to read frame index: file truncated");
+        }
+    }
+
+private:
+    static header describe(const source &src, const config &cfg) {
+        header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MFIX", 4);
+        h.version     = 4; // 3: fmin / fmax は Hz, 4: sample_rate は実効レート
+        h.frame       = cfg.frame;
+        h.hop         = cfg.hop;
+        h.fft         = cfg.fft;
+        h.channel     = cfg.channel;
+        h.mfcc_dim    = cfg.mfcc_dim;
+        h.sample_rate = with_rate(cfg, src.header.sample_rate).rate;
+        h.fmin        = cfg.fmin;
+        h.fmax        = cfg.fmax;
+        h.frames      = frame_count(src.samples, cfg);
+        return h;
+    }
+
+    std::ifstream ifs_;
+    header        header_;
+};
+
+/********************************************************************************
+ *
+ * feature_file
+ *
+ * compact binary storage of a frames x dim feature matrix as float32, fp16 or int8.
+ * for int8 the scale / offset pairs (one per utterance or one per dimension) follow
+ * the header, and the data is stored row-major after them.
+ *
+ ********************************************************************************/
+enum storage : uint32_t {
+    STORE_F32  = 0,
+    STORE_F16  = 1,
+    STORE_INT8 = 2,
+};
+
+enum scaling : uint32_t {
+    SCALE_UTTERANCE = 0,
+    SCALE_DIMENSION = 1,
+};
+
+class feature_file {
+public:
+    struct header {
+        char     magic[4]; // "MFQT"
+        uint32_t version;
+        uint32_t type;     // storage
+        uint32_t scaling;
+        uint32_t dim;
+        uint32_t params;   // scale / offset pairs after the header (0, 1 or dim)
+        uint64_t frames;
+    };
+
+    static std::string path(const std::string &fn) {return fn + ".feat"; }
+
+    static void write(const std::string &path, const std::vector<vec_t> &feats, storage type, scaling mode) {
+        std::ofstream ofs(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!ofs) {
+            throw std::runtime_error(format_str("failed to write %s", path.c_str()));
+        }
+        write(ofs, feats, type, mode);
+        ofs.close();
+    }
+
+    /**
+     * ストリームの現在位置に1発話分を書く (複数の発話を続けて書いてもよい)
+     */
+    static void write(std::ostream &ofs, const std::vector<vec_t> &feats, storage type, scaling mode) {
+        const size_t dim    = feats.empty() ? 0 : feats[0].size();
+        const size_t frames = feats.size();
+
+        header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MFQT", 4);
+        h.version = 1;
+        h.type    = type;
+        h.scaling = mode;
+        h.dim     = dim;
+        h.frames  = frames;
+
+        if (type == STORE_F32) {
+            ofs.write((char *)&h, sizeof(h));
+            for (auto &f : feats) {
+                ofs.write((char *)f.data(), dim * sizeof(float));
+            }
+        } else if (type == STORE_F16) {
+            ofs.write((char *)&h, sizeof(h));
+            std::vector<uint16_t> buf(dim);
+            for (auto &f : feats) {
+                float_to_half(f.data(), buf.data(), dim);
+                ofs.write((char *)buf.data(), dim * sizeof(uint16_t));
+            }
+        } else if (type == STORE_INT8) {
+            // 値の範囲から scale / offset を決める
+            const size_t params = mode == SCALE_DIMENSION ? dim : 1;
+            vec_t        lo(params, std::numeric_limits<float>::max());
+            vec_t        hi(params, -std::numeric_limits<float>::max());
+            for (auto &f : feats) {
+                for (size_t d = 0; d < dim; d++) {
+                    const size_t p = params == 1 ? 0 : d;
+                    lo[p] = std::min(lo[p], f[d]);
+                    hi[p] = std::max(hi[p], f[d]);
+                }
+            }
+            vec_t scale(params), offset(params);
+            for (size_t p = 0; p < params; p++) {
+                const bool empty = lo[p] > hi[p];
+                scale[p]  = empty || hi[p] == lo[p] ? 1.0f : (hi[p] - lo[p]) / 254.0f;
+                offset[p] = empty ? 0.0f : 0.5f * (hi[p] + lo[p]);
+            }
+
+            h.params = params;
+            ofs.write((char *)&h, sizeof(h));
+            ofs.write((char *)scale.data(), params * sizeof(float));
+            ofs.write((char *)offset.data(), params * sizeof(float));
+
+            vec_t               inv_row(dim), offset_row(dim);
+            std::vector<int8_t> buf(dim);
+            for (size_t d = 0; d < dim; d++) {
+                inv_row[d]    = 1.0f / scale[params == 1 ? 0 : d];
+                offset_row[d] = offset[params == 1 ? 0 : d];
+            }
+            for (auto &f : feats) {
+                quantize_int8(f.data(), buf.data(), dim, inv_row.data(), offset_row.data());
+                ofs.write((char *)buf.data(), dim);
+            }
+        } else {
+            throw std::runtime_error("failed to write features: unknown storage type");
+        }
+    }
+
+    static void read(const std::string &path, std::vector<vec_t> &feats) {
+        std::ifstream ifs(path, std::ios::in | std::ios::binary);
+        if (!ifs) {
+            throw std::runtime_error(format_str("failed to open %s", path.c_str()));
+        }
+        read(ifs, feats, path);
+    }
+
+    /**
+     * ストリームの現在位置から1発話分を読む (name はエラーメッセージ用)
+     */
+    static void read(std::istream &ifs, std::vector<vec_t> &feats, const std::string &name = "stream") {
+        const std::string &path = name;
+
+        header h;
+        ifs.read((char *)&h, sizeof(h));
+        if (!ifs || memcmp(h.magic, "MFQT", 4) != 0 || h.version != 1) {
+            throw std::runtime_error(format_str("failed to read %s: not a feature file", path.c_str()));
+        }
+
+        const size_t dim = h.dim;
+        feats.assign(h.frames, vec_t(dim));
+        if (h.type == STORE_F32) {
+            for (auto &f : feats) {
+                ifs.read((char *)f.data(), dim * sizeof(float));
+            }
+        } else if (h.type == STORE_F16) {
+            std::vector<uint16_t> buf(dim);
+            for (auto &f : feats) {
+                ifs.read((char *)buf.data(), dim * sizeof(uint16_t));
+                half_to_float(buf.data(), f.data(), dim);
+            }
+        } else if (h.type == STORE_INT8) {
+            const size_t params = h.params;
+            if (params != 1 && params != dim) {
+                throw std::runtime_error(format_str("failed to read %s: invalid scale count", path.c_str()));
+            }
+            vec_t scale(params), offset(params);
+            ifs.read((char *)scale.data(), params * sizeof(float));
+            ifs.read((char *)offset.data(), params * sizeof(float));
+
+            vec_t scale_row(dim), offset_row(dim);
+            for (size_t d = 0; d < dim; d++) {
+                scale_row[d]  = scale[params == 1 ? 0 : d];
+                offset_row[d] = offset[params == 1 ? 0 : d];
+            }
+            std::vector<int8_t> buf(dim);
+            for (auto &f : feats) {
+                ifs.read((char *)buf.data(), dim);
+                dequantize_int8(buf.data(), f.data(), dim, scale_row.data(), offset_row.data());
+            }
+        } else {
+            throw std::runtime_error(format_str("failed to read %s: unknown storage type", path.c_str()));
+        }
+        if (!ifs) {
+            throw std::runtime_error(format_str("failed to read %s: file truncated", path.c_str()));
+        }
+    }
+};
+
+/**
+ * 量子化した特徴量を float32 の特徴量と比べる
+ */
+struct accuracy {
+    size_t elements;    // 要素数
+    size_t near;        // cc::is_near を満たす要素数
+    size_t frames;      // フレーム数
+    size_t frames_near; // 全要素が cc::is_near を満たすフレーム数
+    double max_abs;     // 最大絶対誤差
+    double rms;         // 二乗平均平方根誤差
+};
+
+inline accuracy compare(const std::vector<vec_t> &ref, const std::vector<vec_t> &got) {
+    if (ref.size() != got.size()) {
+        throw std::runtime_error("failed to compare features: frame count differs");
+    }
+    accuracy a = accuracy();
+    double   sq = 0.0;
+    for (size_t k = 0; k < ref.size(); k++) {
+        a.frames++;
+        a.frames_near += is_near(ref[k], got[k]) ? 1 : 0;
+        for (size_t d = 0; d < ref[k].size(); d++) {
+            const double err = std::abs((double)ref[k][d] - got[k][d]);
+            a.elements++;
+            a.near   += is_near(ref[k][d], got[k][d]) ? 1 : 0;
+            a.max_abs = std::max(a.max_abs, err);
+            sq       += err * err;
+        }
+    }
+    a.rms = a.elements ? std::sqrt(sq / a.elements) : 0.0;
+    return a;
+}
+
+/********************************************************************************
+ *
+ * sink
+ *
+ * text writer for one kind of output: one frame per line, values separated by spaces.
+ * "-" means stdout.
+ *
+ ********************************************************************************/
+class sink {
+public:
+    explicit sink(const std::string &path) : os_(&std::cout) {
+        if (path != "-") {
+            ofs_.open(path, std::ios::out | std::ios::trunc);
+            if (!ofs_) {
+                throw std::runtime_error(format_str("failed to write %s", path.c_str()));
+            }
+            os_ = &ofs_;
+        }
+    }
+
+    void comment(const std::string &str) {
+        *os_ << "# " << str << "\n";
+    }
+
+    void write(const float *p, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (i) *os_ << " ";
+            *os_ << p[i];
+        }
+        *os_ << "\n";
+    }
+
+    void write(const vec_t &v) {write(v.data(), v.size()); }
+
+    void flush() {os_->flush(); }
+
+private:
+    std::ofstream ofs_;
+    std::ostream *os_;
+};
+
+/**
+ * 要求された出力をそれぞれのシンクに書き出す
+ */
+struct sinks {
+    std::unique_ptr<sink> spec;
+    std::unique_ptr<sink> fbank;
+    std::unique_ptr<sink> mfcc;
+    std::unique_ptr<sink> energy;
+
+    unsigned mask() const {
+        return (spec ? OUT_SPEC : 0) | (fbank ? OUT_FBANK : 0) | (mfcc ? OUT_MFCC : 0) | (energy ? OUT_ENERGY : 0);
+    }
+
+    void comment(const std::string &str) {
+        for (sink *s : {spec.get(), fbank.get(), mfcc.get(), energy.get()}) {
+            if (s) s->comment(str);
+        }
+    }
+
+    void write(const frame_outputs &out) {
+        if (spec)   spec->write(out.amp);
+        if (fbank)  fbank->write(out.fbank);
+        if (mfcc)   mfcc->write(out.mfcc);
+        if (energy) energy->write(&out.energy, 1);
+    }
+
+    void flush() {
+        for (sink *s : {spec.get(), fbank.get(), mfcc.get(), energy.get()}) {
+            if (s) s->flush();
+        }
+    }
+};
+
+/********************************************************************************
+ *
+ * engine
+ *
+ * multiplexes many live streams onto a fixed worker pool.
+ *
+ * each stream keeps its own pre-emphasis state and a ring buffer of samples that
+ * have not yet been consumed by a frame (frame + max_pending * hop samples).
+ * completed frames are cut into the queue with a deadline of arrival + budget,
+ * but never more than max_pending per stream: the rest stay in the ring and are
+ * cut by push() or by the worker that frees a slot. workers take batches of the
+ * earliest-deadline frames across all streams, so a burst on one stream cannot
+ * starve the others. push() accepts only what fits in the ring and returns the
+ * number of samples taken; the caller retries with the remainder.
+ *
+ * the callback runs on worker threads, possibly out of order within a stream
+ * (the frame index is passed along). an exception thrown by the analysis or the
+ * callback is confined to its frame: it is counted in metrics::errors and the
+ * last message is kept per stream (error()); the worker moves on.
+ *
+ ********************************************************************************/
+class engine {
+public:
+    struct metrics {
+        size_t frames_in;  // 切り出したフレーム数
+        size_t frames_out; // 計算済みフレーム数
+        size_t pending;    // 待ち行列にあるフレーム数
+        size_t missed;     // 締め切りに間に合わなかったフレーム数
+        size_t rejected;   // 背圧で全部は受け付けなかった push() の回数
+        size_t errors;     // 解析かコールバックが例外を投げたフレーム数
+        double max_lag;    // 到着から計算完了までの最大遅延 (秒)
+        double mean_lag;   // 同平均 (秒)
+    };
+
+    typedef std::function<void(int, size_t, const frame_outputs &)> callback;
+
+    engine(const config &cfg, size_t workers, double budget, size_t max_pending, size_t batch, const callback &cb)
+        : cfg_(cfg), budget_(budget), max_pending_(std::max<size_t>(max_pending, 1)), batch_(std::max<size_t>(batch, 1)),
+          cb_(cb), stop_(false), in_flight_(0), histogram_(BUCKETS, 0), epoch_(std::chrono::steady_clock::now()) {
+        // 設定の誤りはワーカーの中ではなくここで投げる
+        int lo, hi;
+        band(cfg_, lo, hi);
+        for (size_t i = 0; i < std::max<size_t>(workers, 1); i++) {
+            workers_.emplace_back([this] {work(); });
+        }
+    }
+
+    engine(const engine &)            = delete;
+    engine &operator=(const engine &) = delete;
+
+    ~engine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_cv_.notify_all();
+        for (auto &w : workers_) {
+            w.join();
+        }
+    }
+
+    int open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.emplace_back(new stream_state());
+        streams_.back()->id = (int)streams_.size() - 1;
+        streams_.back()->ring.resize(cfg_.frame + max_pending_ * cfg_.hop);
+        return streams_.back()->id;
+    }
+
+    /**
+     * ストリームにサンプルを追加する (ストリームごとに1スレッドから呼ぶこと)
+     * リングバッファに入った分だけ受け付けて、その数を返す (詰まっているときは 0)
+     */
+    size_t push(int id, const float *p, size_t n) {
+        stream_state *s   = find(id);
+        const size_t  cap = s->ring.size();
+        size_t        taken, cut;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cut = cut_frames(s);
+
+            // プリエンファシスはストリームをまたいで連続にかける
+            for (taken = 0; taken < n && (s->skip || s->count < cap); taken++) {
+                const float x = p[taken];
+                const float y = s->started ? (float)(x - 0.97 * s->prev) : x;
+                s->prev    = x;
+                s->started = true;
+                if (s->skip) {
+                    s->skip--;
+                    continue;
+                }
+                s->ring[(s->start + s->count) % cap] = y;
+                s->count++;
+            }
+            s->arrival = clock();
+            cut       += cut_frames(s);
+            s->m.rejected += taken < n ? 1 : 0;
+        }
+        if (cut) {
+            ready_cv_.notify_all();
+        }
+        return taken;
+    }
+
+    /**
+     * 待ち行列が空になり、すべてのフレームの計算が終わるまで待つ
+     */
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_cv_.wait(lock, [this] {return queue_.empty() && in_flight_ == 0; });
+    }
+
+    metrics stats(int id) {
+        stream_state               *s = find(id);
+        std::lock_guard<std::mutex> lock(mutex_);
+        metrics m = s->m;
+        m.mean_lag = m.frames_out ? s->lag_sum / m.frames_out : 0.0;
+        return m;
+    }
+
+    /**
+     * ストリームで最後に起きたエラーのメッセージ (なければ空)
+     */
+    std::string error(int id) {
+        stream_state               *s = find(id);
+        std::lock_guard<std::mutex> lock(mutex_);
+        return s->error;
+    }
+
+    size_t streams() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return streams_.size();
+    }
+
+    /**
+     * 全ストリームの遅延の p 分位点 (秒)
+     */
+    double latency_percentile(double p) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t total = 0;
+        for (auto c : histogram_) total += c;
+        if (total == 0) {
+            return 0.0;
+        }
+        const size_t rank = (size_t)std::ceil(p * total);
+        size_t       acc  = 0;
+        for (size_t b = 0; b < BUCKETS; b++) {
+            acc += histogram_[b];
+            if (acc >= rank) {
+                return bucket_upper(b);
+            }
+        }
+        return bucket_upper(BUCKETS - 1);
+    }
+
+private:
+    static const size_t BUCKETS = 128; // 10us から 1.2 倍刻み
+
+    static double bucket_upper(size_t b) {return 1e-5 * std::pow(1.2, (double)b + 1); }
+
+    static size_t bucket_of(double lag) {
+        if (lag <= 1e-5) return 0;
+        size_t b = (size_t)(std::log(lag / 1e-5) / std::log(1.2));
+        return std::min(b, BUCKETS - 1);
+    }
+
+    struct stream_state {
+        int     id         = 0;
+        float   prev       = 0.0f;  // 直前のサンプル (プリエンファシス用)
+        bool    started    = false;
+        vec_t   ring;               // プリエンファシス済みで未消費のサンプル
+        size_t  start      = 0;     // ring 内の次フレームの開始位置
+        size_t  count      = 0;     // ring 内のサンプル数
+        size_t  skip       = 0;     // hop > frame のとき、これから届く分で読み飛ばすサンプル数
+        double  arrival    = 0.0;   // 最後にサンプルが届いた時刻
+        size_t  next_frame = 0;
+        metrics m          = metrics();
+        double  lag_sum    = 0.0;
+        std::string error;          // 最後のエラー
+    };
+
+    struct task {
+        double        deadline;
+        double        arrival;
+        stream_state *s;
+        size_t        k;
+        vec_t        *frame;
+
+        bool operator<(const task &rhs) const {return deadline > rhs.deadline; } // earliest deadline first
+    };
+
+    double clock() const {
+        return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    stream_state *find(int id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (id < 0 || (size_t)id >= streams_.size()) {
+            throw std::runtime_error(format_str("invalid stream id %d", id));
+        }
+        return streams_[id].get();
+    }
+
+    // mutex_ を取った状態で呼ぶ
+    vec_t *acquire() {
+        if (pool_.empty()) {
+            buffers_.emplace_back(new vec_t(cfg_.frame));
+            return buffers_.back().get();
+        }
+        vec_t *buf = pool_.back();
+        pool_.pop_back();
+        return buf;
+    }
+
+    /**
+     * 完成したフレームを待ち行列の上限まで切り出す (mutex_ を取った状態で呼ぶ)
+     */
+    size_t cut_frames(stream_state *s) {
+        const size_t frame = cfg_.frame;
+        const size_t cap   = s->ring.size();
+        size_t       cut   = 0;
+        while (s->m.pending < max_pending_ && s->count >= frame) {
+            vec_t       *buf   = acquire();
+            const size_t first = std::min(frame, cap - s->start);
+            std::copy(s->ring.begin() + s->start, s->ring.begin() + s->start + first, buf->begin());
+            std::copy(s->ring.begin(), s->ring.begin() + (frame - first), buf->begin() + first);
+            queue_.push(task {s->arrival + budget_, s->arrival, s, s->next_frame++, buf});
+
+            const size_t drop = std::min((size_t)cfg_.hop, s->count);
+            s->start  = (s->start + drop) % cap;
+            s->count -= drop;
+            s->skip   = cfg_.hop - drop;
+            s->m.frames_in++;
+            s->m.pending++;
+            cut++;
+        }
+        return cut;
+    }
+
+    void work() {
+        std::vector<task>   batch;
+        std::vector<double>      done;
+        std::vector<std::string> errors;
+        frame_outputs            out, out_b;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_cv_.wait(lock, [this] {return stop_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+                while (!queue_.empty() && batch.size() < batch_) {
+                    batch.push_back(queue_.top());
+                    queue_.pop();
+                }
+                in_flight_ += batch.size();
+            }
+
+            size_t cut = 0;
+
+            // 2フレームずつまとめて変換する (例外はそのフレームだけの失敗にする)
+            errors.assign(batch.size(), std::string());
+            auto deliver = [&](size_t j, const frame_outputs &o) {
+                try {
+                    cb_(batch[j].s->id, batch[j].k, o);
+                } catch (const std::exception &e) {
+                    errors[j] = e.what();
+                } catch (...) {
+                    errors[j] = "unknown error";
+                }
+            };
+            size_t i = 0;
+            for (; i + 1 < batch.size(); i += 2) {
+                try {
+                    analyze(*batch[i].frame, *batch[i + 1].frame, cfg_, out, out_b);
+                    deliver(i, out);
+                    deliver(i + 1, out_b);
+                } catch (const std::exception &e) {
+                    errors[i] = errors[i + 1] = e.what();
+                }
+                done.push_back(clock());
+                done.push_back(clock());
+            }
+            if (i < batch.size()) {
+                try {
+                    analyze(*batch[i].frame, cfg_, out);
+                    deliver(i, out);
+                } catch (const std::exception &e) {
+                    errors[i] = e.what();
+                }
+                done.push_back(clock());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (size_t i = 0; i < batch.size(); i++) {
+                    const task  &t   = batch[i];
+                    const double lag = done[i] - t.arrival;
+                    metrics     &m   = t.s->m;
+                    m.pending--;
+                    pool_.push_back(t.frame);
+                    if (!errors[i].empty()) {
+                        m.errors++;
+                        t.s->error = errors[i];
+                        continue;
+                    }
+                    m.frames_out++;
+                    m.missed    += done[i] > t.deadline ? 1 : 0;
+                    m.max_lag    = std::max(m.max_lag, lag);
+                    t.s->lag_sum += lag;
+                    histogram_[bucket_of(lag)]++;
+                }
+                // 空いた枠の分だけリングに残っていたフレームを切り出す
+                for (const task &t : batch) {
+                    cut += cut_frames(t.s);
+                }
+                in_flight_ -= batch.size();
+            }
+            if (cut) {
+                ready_cv_.notify_all();
+            }
+            idle_cv_.notify_all();
+            batch.clear();
+            done.clear();
+        }
+    }
+
+    config   cfg_;
+    double   budget_;
+    size_t   max_pending_;
+    size_t   batch_;
+    callback cb_;
+
+    std::mutex                                 mutex_;
+    std::condition_variable                    ready_cv_;
+    std::condition_variable                    idle_cv_;
+    bool                                       stop_;
+    size_t                                     in_flight_;
+    std::priority_queue<task>                  queue_;
+    std::vector<std::unique_ptr<stream_state>> streams_;
+    std::vector<std::unique_ptr<vec_t>>        buffers_;
+    std::vector<vec_t *>                       pool_;
+    std::vector<size_t>                        histogram_;
+    std::vector<std::thread>                   workers_;
+
+    std::chrono::steady_clock::time_point epoch_;
+};
+} // namespace wav
@@ -0,0 +1,341 @@
+#pragma once
+
+#include "./mfcc.hpp"
+
+namespace wav {
+/********************************************************************************
+ *
+ * search
+ *
+ * spots known templates (MFCC sequences) inside a long recording.
+ *
+ * every template is compared with every window of the same length in the
+ * recording using DTW (squared euclidean ground distance) restricted to a
+ * Sakoe-Chiba band of +-r frames. before running DTW a window is checked against
+ * LB_Keogh: the template's upper / lower envelope over the band gives a lower
+ * bound of the DTW distance, and windows whose bound is not better than the
+ * current k-th best are skipped. DTW itself abandons a window as soon as a whole
+ * row exceeds the k-th best.
+ *
+ * windows a few frames apart from a good match are almost as good, so a match is
+ * only kept if no better match of the same template starts within `exclusion`
+ * times the template length of it. otherwise the top k would be filled with
+ * shifted copies of a single occurrence. each thread keeps its plain top
+ * k * (2 * zone - 1) windows, which is enough to contain the k survivors, and the
+ * exclusion runs once over the merged list, so the result does not depend on how
+ * the work was split.
+ *
+ * sequences are stored dimension-major so that the distances of one template
+ * frame to a run of recording frames (the DTW cost row) and the envelope bound
+ * are computed with vector loads across frames.
+ *
+ ********************************************************************************/
+
+/**
+ * frames x dim の特徴量を次元ごとに並べ直したもの (data[d * frames + i])
+ */
+struct sequence {
+    size_t frames = 0;
+    size_t dim    = 0;
+    vec_t  data;
+
+    sequence() {}
+
+    explicit sequence(const std::vector<vec_t> &feats) : frames(feats.size()), dim(feats.empty() ? 0 : feats[0].size()), data(frames * dim) {
+        for (size_t i = 0; i < frames; i++) {
+            if (feats[i].size() != dim) {
+                throw std::runtime_error("failed to build sequence: frame size differs");
+            }
+            for (size_t d = 0; d < dim; d++) {
+                data[d * frames + i] = feats[i][d];
+            }
+        }
+    }
+
+    const float *row(size_t d) const {return &data[d * frames]; }
+};
+
+struct match {
+    size_t tpl;      // テンプレート番号
+    size_t offset;   // 録音内の開始フレーム
+    float  distance; // DTW距離 (二乗ユークリッド距離の累積)
+
+    // 距離が同じときも順序が決まるようにテンプレート, 位置で比べる
+    bool operator<(const match &rhs) const {
+        if (distance != rhs.distance) return distance < rhs.distance;
+        if (tpl != rhs.tpl) return tpl < rhs.tpl;
+        return offset < rhs.offset;
+    }
+};
+
+#ifdef CC_SIMD_AVX2
+CC_TARGET_AVX2 inline size_t cost_row_avx2(const float *q, const sequence &s, size_t j0, size_t count, float *out) {
+    size_t j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t d = 0; d < s.dim; d++) {
+            const __m256 v = _mm256_sub_ps(_mm256_loadu_ps(s.row(d) + j0 + j), _mm256_set1_ps(q[d]));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+        }
+        _mm256_storeu_ps(out + j, acc);
+    }
+    return j;
+}
+
+CC_TARGET_AVX2 inline float lb_keogh_avx2(const float *upper, const float *lower, size_t m, const sequence &s, size_t offset, size_t d, size_t &i) {
+    const __m256 zero = _mm256_setzero_ps();
+    __m256       acc  = zero;
+    for (i = 0; i + 8 <= m; i += 8) {
+        const __m256 c  = _mm256_loadu_ps(s.row(d) + offset + i);
+        const __m256 hi = _mm256_max_ps(_mm256_sub_ps(c, _mm256_loadu_ps(upper + i)), zero);
+        const __m256 lo = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(lower + i), c), zero);
+        const __m256 e  = _mm256_add_ps(hi, lo);
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(e, e));
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, acc);
+    return ((buf[0] + buf[1]) + (buf[2] + buf[3])) + ((buf[4] + buf[5]) + (buf[6] + buf[7]));
+}
+#endif // ifdef CC_SIMD_AVX2
+
+/**
+ * テンプレートの1フレーム q と録音のフレーム [j0, j0 + count) との二乗距離
+ */
+inline void cost_row(const float *q, const sequence &s, size_t j0, size_t count, float *out) {
+    size_t j = 0;
+#ifdef CC_SIMD_AVX2
+    if (simd_width() >= 8) j = cost_row_avx2(q, s, j0, count, out);
+#endif
+    for (; j < count; j++) {
+        float acc = 0.0f;
+        for (size_t d = 0; d < s.dim; d++) {
+            const float v = s.row(d)[j0 + j] - q[d];
+            acc += v * v;
+        }
+        out[j] = acc;
+    }
+}
+
+class template_index {
+public:
+    /**
+     * band はテンプレート長に対するSakoe-Chiba帯の幅の割合、
+     * exclusion は同じテンプレートの一致を1つにまとめる範囲のテンプレート長に対する割合
+     */
+    explicit template_index(float band = 0.1f, float exclusion = 1.0f) : band_(band), exclusion_(exclusion) {}
+
+    size_t add(const std::string &name, const std::vector<vec_t> &feats) {
+        if (feats.empty()) {
+            throw std::runtime_error(format_str("failed to add template %s: no frames", name.c_str()));
+        }
+        if (!entries_.empty() && feats[0].size() != entries_[0].seq.dim) {
+            throw std::runtime_error(format_str("failed to add template %s: dimension differs", name.c_str()));
+        }
+
+        entry e;
+        e.name   = name;
+        e.seq    = sequence(feats);
+        e.radius = (size_t)std::ceil(band_ * e.seq.frames);
+        e.zone   = std::max<size_t>((size_t)std::ceil(exclusion_ * e.seq.frames), 1);
+
+        // 行優先のコピー (DTWのコスト行で1フレーム分を読む)
+        const size_t m = e.seq.frames, dim = e.seq.dim;
+        e.rows.resize(m * dim);
+        for (size_t i = 0; i < m; i++) {
+            std::copy(feats[i].begin(), feats[i].end(), e.rows.begin() + i * dim);
+        }
+
+        // 帯の幅で上下の包絡線を作る
+        e.upper.resize(m * dim);
+        e.lower.resize(m * dim);
+        for (size_t d = 0; d < dim; d++) {
+            const float *x = e.seq.row(d);
+            for (size_t i = 0; i < m; i++) {
+                const size_t lo = i >= e.radius ? i - e.radius : 0;
+                const size_t hi = std::min(i + e.radius + 1, m);
+                auto         mm = std::minmax_element(x + lo, x + hi);
+                e.lower[d * m + i] = *mm.first;
+                e.upper[d * m + i] = *mm.second;
+            }
+        }
+
+        entries_.push_back(std::move(e));
+        return entries_.size() - 1;
+    }
+
+    size_t             size() const             {return entries_.size(); }
+    const std::string &name(size_t tpl) const   {return entries_[tpl].name; }
+    size_t             frames(size_t tpl) const {return entries_[tpl].seq.frames; }
+
+    /**
+     * 録音の全位置とすべてのテンプレートを比べ、距離の小さい順に k 件返す
+     */
+    std::vector<match> search(const std::vector<vec_t> &feats, size_t k, size_t threads) const {
+        const sequence s(feats);
+        if (k == 0 || entries_.empty() || s.frames == 0) {
+            return std::vector<match>();
+        }
+        if (s.dim != entries_[0].seq.dim) {
+            throw std::runtime_error("failed to search: dimension differs from templates");
+        }
+
+        // (テンプレート, 開始位置のブロック) を作業単位にしてスレッドに配る
+        const size_t               block = 256;
+        std::vector<std::pair<size_t, size_t>> units;
+        for (size_t t = 0; t < entries_.size(); t++) {
+            const size_t m = entries_[t].seq.frames;
+            if (m > s.frames) continue;
+            for (size_t o = 0; o <= s.frames - m; o += block) {
+                units.push_back(std::make_pair(t, o));
+            }
+        }
+
+        // 除外で捨てられるのは採用された一致1つにつき前後 zone - 1 件までなので、
+        // 除外する前の上位 k * (2 * zone - 1) 件に除外した後の上位 k 件がすべて入る
+        size_t zone = 1;
+        for (auto &e : entries_) {
+            zone = std::max(zone, e.zone);
+        }
+        const size_t keep = k * (2 * zone - 1);
+
+        threads = std::max<size_t>(threads, 1);
+        std::atomic<size_t>             next(0);
+        std::vector<std::vector<match>> best(threads); // スレッドごとの上位 keep 件 (除外なし)
+        std::vector<std::thread>        workers;
+        for (size_t w = 0; w < threads; w++) {
+            workers.emplace_back([&, w] {
+                std::vector<match> &top = best[w];
+                std::vector<float>  work;
+                for (size_t u; (u = next++) < units.size();) {
+                    const size_t t    = units[u].first;
+                    const size_t m    = entries_[t].seq.frames;
+                    const size_t last = std::min(units[u].second + block, s.frames - m + 1);
+                    for (size_t o = units[u].second; o < last; o++) {
+                        const float threshold = top.size() < keep ? std::numeric_limits<float>::max() : top.back().distance;
+                        if (lb_keogh(t, s, o, threshold) > threshold) {
+                            continue;
+                        }
+                        const match m {t, o, dtw(t, s, o, threshold, work)};
+                        if (m.distance < std::numeric_limits<float>::max() && (top.size() < keep || m < top.back())) {
+                            top.insert(std::upper_bound(top.begin(), top.end(), m), m);
+                            if (top.size() > keep) {
+                                top.pop_back();
+                            }
+                        }
+                    }
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+
+        // まとめて距離順に並べ、同じテンプレートの近くにより良い一致があるものを捨てる
+        std::vector<match> all, result;
+        for (auto &top : best) {
+            all.insert(all.end(), top.begin(), top.end());
+        }
+        std::sort(all.begin(), all.end());
+        for (auto &m : all) {
+            if (result.size() == k) {
+                break;
+            }
+            if (!near(result, m)) {
+                result.push_back(m);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * テンプレート tpl と録音の位置 offset からの窓との LB_Keogh (threshold を超えた時点で打ち切る)
+     */
+    float lb_keogh(size_t tpl, const sequence &s, size_t offset, float threshold) const {
+        const entry &e   = entries_[tpl];
+        const size_t m   = e.seq.frames;
+        float        sum = 0.0f;
+        for (size_t d = 0; d < e.seq.dim && sum < threshold; d++) {
+            const float *upper = &e.upper[d * m];
+            const float *lower = &e.lower[d * m];
+            size_t       i     = 0;
+#ifdef CC_SIMD_AVX2
+            if (simd_width() >= 8) sum += lb_keogh_avx2(upper, lower, m, s, offset, d, i);
+#endif
+            for (; i < m; i++) {
+                const float c  = s.row(d)[offset + i];
+                const float hi = std::max(c - upper[i], 0.0f);
+                const float lo = std::max(lower[i] - c, 0.0f);
+                sum += (hi + lo) * (hi + lo);
+            }
+        }
+        return sum;
+    }
+
+    /**
+     * Sakoe-Chiba帯つきのDTW距離 (ある行の最小値が threshold を超えたら打ち切って max を返す)
+     */
+    float dtw(size_t tpl, const sequence &s, size_t offset, float threshold, std::vector<float> &work) const {
+        const entry &e   = entries_[tpl];
+        const size_t m   = e.seq.frames;
+        const size_t r   = e.radius;
+        const float  INF = std::numeric_limits<float>::max();
+
+        // prev / cur は列 j を j + 1 に置き、0 番目を境界にする
+        work.assign(3 * (m + 2), INF);
+        float *prev = &work[0];
+        float *cur  = &work[m + 2];
+        float *cost = &work[2 * (m + 2)];
+
+        for (size_t i = 0; i < m; i++) {
+            const size_t jlo = i >= r ? i - r : 0;
+            const size_t jhi = std::min(i + r, m - 1);
+
+            cost_row(&e.rows[i * e.seq.dim], s, offset + jlo, jhi - jlo + 1, cost);
+
+            cur[jlo]     = INF;
+            cur[jhi + 2] = INF;
+            float row_min = INF;
+            for (size_t j = jlo; j <= jhi; j++) {
+                const float best = (i == 0 && j == 0) ? 0.0f : std::min(std::min(prev[j + 1], prev[j]), cur[j]);
+                const float v    = best == INF ? INF : best + cost[j - jlo];
+                cur[j + 1] = v;
+                row_min    = std::min(row_min, v);
+            }
+            if (row_min > threshold) {
+                return INF;
+            }
+            std::swap(prev, cur);
+        }
+        return prev[m];
+    }
+
+private:
+    /**
+     * 採用済みの一致 found のうち、m と同じテンプレートで zone より近いものがあるか
+     */
+    bool near(const std::vector<match> &found, const match &m) const {
+        const size_t zone = entries_[m.tpl].zone;
+        for (auto &e : found) {
+            const size_t gap = e.offset > m.offset ? e.offset - m.offset : m.offset - e.offset;
+            if (e.tpl == m.tpl && gap < zone) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct entry {
+        std::string name;
+        sequence    seq;    // 次元ごと
+        vec_t       rows;   // フレームごと
+        vec_t       upper;  // 包絡線 (次元ごと)
+        vec_t       lower;
+        size_t      radius; // Sakoe-Chiba帯の半径 (フレーム数)
+        size_t      zone;   // 一致を1つにまとめる範囲 (フレーム数)
+    };
+
+    float              band_;
+    float              exclusion_;
+    std::vector<entry> entries_;
+};
+} // namespace wav
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "./search.hpp"
+
+namespace wav {
+/********************************************************************************
+ *
+ * tuning
+ *
+ * the fastest transform kind, chirp-z versus real FFT for the band, FFT radix
+ * order, number of frames per transform, thread count and SIMD width depend on
+ * the machine. autotune() times the
+ * candidates for a given config with cc::timer on synthetic input, and the
+ * winners are kept per config in a text profile (like FFTW wisdom) that is read
+ * at startup:
+ *
+ *   frame=1024 hop=512 fft=44000 channel=20 rate=0 fmin=0 fmax=0 : transform=2 zoom=0 radix=0 tile=2 threads=4 simd=8
+ *
+ ********************************************************************************/
+struct tuning {
+    int transform = TRANSFORM_FFT;
+    int zoom      = -1;
+    int radix     = 0;
+    int tile      = 2;
+    int threads   = 1;
+    int simd      = 1;
+};
+
+/**
+ * チューニング結果を引くためのキー (計算量に効く設定だけを含む)
+ * 帯域のビンはサンプリング周波数で変わるので、帯域を指定したときはレートも含める
+ */
+inline std::string tuning_key(const config &cfg) {
+    const bool full = cfg.fmin == 0.0f && cfg.fmax == 0.0f;
+    return format_str("frame=%d hop=%d fft=%d channel=%d rate=%d fmin=%g fmax=%g",
+                      cfg.frame, cfg.hop, cfg.fft, cfg.channel, full ? 0 : cfg.rate, cfg.fmin, cfg.fmax);
+}
+
+/**
+ * 設定にチューニング結果を反映する (スレッド数は呼び出し側が使う)
+ */
+inline void apply(const tuning &t, config &cfg) {
+    cfg.transform = t.transform;
+    cfg.zoom      = t.zoom;
+    cfg.radix     = t.radix;
+    cfg.tile      = t.tile;
+}
+
+class tuning_profile {
+public:
+    /**
+     * $MFCC_TUNING, なければ $HOME/.mfcc_tuning
+     */
+    static std::string default_path() {
+        if (const char *p = std::getenv("MFCC_TUNING")) {
+            return p;
+        }
+        if (const char *home = std::getenv("HOME")) {
+            return std::string(home) + "/.mfcc_tuning";
+        }
+        return ".mfcc_tuning";
+    }
+
+    bool load(const std::string &path) {
+        std::ifstream ifs(path);
+        if (!ifs) {
+            return false;
+        }
+        for (std::string line; std::getline(ifs, line);) {
+            const size_t sep = line.find(" : ");
+            if (line.empty() || line[0] == '#' || sep == std::string::npos) {
+                continue;
+            }
+            tuning t;
+            if (sscanf(line.c_str() + sep + 3, "transform=%d zoom=%d radix=%d tile=%d threads=%d simd=%d",
+                       &t.transform, &t.zoom, &t.radix, &t.tile, &t.threads, &t.simd) == 6) {
+                entries_[line.substr(0, sep)] = t;
+            }
+        }
+        return true;
+    }
+
+    void save(const std::string &path) const {
+        std::ofstream ofs(path, std::ios::out | std::ios::trunc);
+        if (!ofs) {
+            throw std::runtime_error(format_str("failed to write %s", path.c_str()));
+        }
+        ofs << "# mfcc tuning profile" << std::endl;
+        for (auto &e : entries_) {
+            const tuning &t = e.second;
+            ofs << e.first << " : " << format_str("transform=%d zoom=%d radix=%d tile=%d threads=%d simd=%d",
+                                                  t.transform, t.zoom, t.radix, t.tile, t.threads, t.simd) << std::endl;
+        }
+    }
+
+    bool find(const config &cfg, tuning &t) const {
+        auto it = entries_.find(tuning_key(cfg));
+        if (it == entries_.end()) {
+            return false;
+        }
+        t = it->second;
+        return true;
+    }
+
+    void set(const config &cfg, const tuning &t) {entries_[tuning_key(cfg)] = t; }
+
+private:
+    std::map<std::string, tuning> entries_;
+};
+
+/**
+ * f を reps 回実行して最短の時間 (秒) を返す
+ */
+inline double fastest(int reps, const std::function<void()> &f) {
+    double best = std::numeric_limits<double>::max();
+    for (int r = 0; r < reps; r++) {
+        timer t;
+        f();
+        best = std::min(best, t.elapsed());
+    }
+    return best;
+}
+
+/**
+ * cfg で候補を実際に動かして速いものを選ぶ (log があれば経過を書く)
+ */
+inline tuning autotune(const config &cfg, std::ostream *log = nullptr) {
+    const size_t frames = 32;
+    vec_t        signal(cfg.frame + (frames - 1) * cfg.hop);
+    gaussian_rand(signal.begin(), signal.end(), 0.0f, 0.1f);
+
+    auto run = [&](const config &c, size_t n) {
+        extract(signal, 0, n, c, [](size_t, const frame_outputs &) {});
+    };
+
+    // 変換の方式, chirp-z か実数FFTか, 基数の順番, まとめるフレーム数
+    // (chirp-z は基数もまとめる数も使わないので1通り、実数FFTは分解が変わる基数の順番だけを試す)
+    std::vector<tuning> candidates;
+    {
+        tuning t;
+        t.transform = TRANSFORM_FFT;
+        t.zoom      = 1;
+        t.tile      = 1;
+        candidates.push_back(t);
+    }
+    for (int tile = 1; tile <= 2 && cfg.fft % 2 == 0; tile++) {
+        const int                  n = tile == 2 ? cfg.fft : cfg.fft / 2;
+        std::set<std::vector<int>> seen;
+        for (int radix = 0; radix < 3; radix++) {
+            if (!seen.insert(fft_plan::factorize(n, radix_order(radix))).second) {
+                continue;
+            }
+            tuning t;
+            t.transform = TRANSFORM_FFT;
+            t.zoom      = 0;
+            t.radix     = radix;
+            t.tile      = tile;
+            candidates.push_back(t);
+        }
+    }
+    if (cfg.hop * 8 <= cfg.frame) {
+        tuning t;
+        t.transform = TRANSFORM_SLIDING;
+        candidates.push_back(t);
+    }
+
+    tuning best;
+    double best_time = std::numeric_limits<double>::max();
+    for (auto &t : candidates) {
+        config c = cfg;
+        apply(t, c);
+        run(c, 2); // プランを作っておく
+        const double sec = fastest(3, [&] {run(c, frames); });
+        if (log) *log << format_str("transform=%d zoom=%d radix=%d tile=%d : %.3f ms/frame", t.transform, t.zoom, t.radix, t.tile, sec / frames * 1e3) << std::endl;
+        if (sec < best_time) {
+            best_time = sec;
+            best      = t;
+        }
+    }
+
+    // スレッド数: 各スレッドが同じ量を処理したときのスループットで比べる
+    config tuned = cfg;
+    apply(best, tuned);
+    const int        hw = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<int> counts;
+    for (int n = 1; n < hw; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(hw);
+
+    double rate = 0.0;
+    for (int n : counts) {
+        const double sec = fastest(2, [&] {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < n; i++) {
+                threads.emplace_back([&] {run(tuned, frames); });
+            }
+            for (auto &th : threads) {
+                th.join();
+            }
+        });
+        const double r = n * frames / sec;
+        if (log) *log << format_str("threads=%d : %.1f frames/sec", n, r) << std::endl;
+        if (r > rate * 1.05) { // 5% 以上速くならなければ増やさない
+            rate         = r;
+            best.threads = n;
+        }
+    }
+
+    // SIMD幅: 探索のコスト行カーネルで比べる
+    std::vector<vec_t> feats(4096, vec_t(cfg.mfcc_dim));
+    for (auto &f : feats) {
+        gaussian_rand(f.begin(), f.end(), 0.0f, 1.0f);
+    }
+    const sequence s(feats);
+    vec_t          cost(s.frames);
+    const int      saved = simd_width();
+    double         best_simd = std::numeric_limits<double>::max();
+    for (int w : {1, 8}) {
+        if (w > detect_simd_width()) continue;
+        simd_width() = w;
+        const double sec = fastest(5, [&] {
+            for (size_t i = 0; i < 64; i++) {
+                cost_row(feats[i].data(), s, 0, s.frames, cost.data());
+            }
+        });
+        if (log) *log << format_str("simd=%d : %.3f ms", w, sec * 1e3) << std::endl;
+        if (sec < best_simd) {
+            best_simd = sec;
+            best.simd = w;
+        }
+    }
+    simd_width() = saved;
+
+    return best;
+}
+} // namespace wav
@@ -1,3 +1,6 @@
+#pragma once
+
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <cstdarg>
@@ -9,6 +12,20 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <typeinfo>
+#include <functional>
+#include <memory>
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <cstdint>
+#include <complex>
 
 
 #include <immintrin.h>
@@ -31,13 +48,38 @@ inline void sleep_ms(int milliseconds) {
     std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
 }
 
+/********************************************************************************
+ *
+ * backoff
+ *
+ * wait strategy for polling loops: yields for the first rounds, then sleeps for
+ * a time that doubles up to 1 ms, so that idle threads give the cores back
+ *
+ ********************************************************************************/
+class backoff {
+public:
+    void pause() {
+        if (round_ < 16) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(1 << (round_ - 16), 1000)));
+        }
+        round_ = std::min(round_ + 1, 26);
+    }
+
+    void reset() {round_ = 0; }
+
+private:
+    int round_ = 0;
+};
+
 /********************************************************************************
  *
  * format_str
  *
  ********************************************************************************/
 inline std::string format_str(const char *fmt, ...) {
-    static char buf[2048];
+    thread_local char buf[2048]; // one buffer per thread so concurrent callers don't clobber each other
 #ifdef _MSC_VER
 #pragma warning(disable:4996)
 #endif
@@ -108,6 +150,80 @@ private:
     std::chrono::high_resolution_clock::time_point t1, t2;
 };
 
+/********************************************************************************
+ *
+ * spsc_queue
+ *
+ * bounded lock-free ring for exactly one producer thread and one consumer thread
+ *
+ * @example
+ * spsc_queue<int> q(16);
+ * q.push(1);          // producer
+ * int v = q.pop();    // consumer
+ *
+ ********************************************************************************/
+template<typename T>
+class spsc_queue {
+public:
+    explicit spsc_queue(size_t capacity) : buf_(capacity + 1), head_(0), tail_(0) {}
+
+    spsc_queue(const spsc_queue &)            = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    // C++11 の new は alignas(64) を守らないので、ヒープに置くときも 64 バイト境界にとる
+    static void *operator new(size_t size) {
+        void *p = _mm_malloc(size, 64);
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+
+    static void operator delete(void *p) {_mm_free(p); }
+
+    bool try_push(const T &value) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t next = advance(tail);
+        if (next == head_.load(std::memory_order_acquire)) {
+            return false; // full
+        }
+        buf_[tail] = value;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false; // empty
+        }
+        value = buf_[head];
+        head_.store(advance(head), std::memory_order_release);
+        return true;
+    }
+
+    void push(const T &value) {
+        for (backoff b; !try_push(value);) b.pause();
+    }
+
+    T pop() {
+        T value;
+        for (backoff b; !try_pop(value);) b.pause();
+        return value;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const {return buf_.size() - 1; }
+
+private:
+    size_t advance(size_t i) const {return (i + 1) == buf_.size() ? 0 : i + 1; }
+
+    std::vector<T>      buf_;
+    alignas(64) std::atomic<size_t> head_; // owned by consumer (head_ and tail_ on separate cache lines)
+    alignas(64) std::atomic<size_t> tail_; // owned by producer
+};
+
 /********************************************************************************
  *
  * progress_display
@@ -335,6 +451,181 @@ inline void nop() {
     // do nothing
 }
 
+/********************************************************************************
+ *
+ * simd
+ *
+ * kernels below have a scalar variant and an AVX2/F16C variant (8 lanes). the
+ * vector variant is compiled with a target attribute and picked at runtime, so
+ * the binary still runs on machines without AVX2.
+ *
+ ********************************************************************************/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CC_SIMD_AVX2 1
+#define CC_TARGET_AVX2 __attribute__((target("avx2,f16c")))
+#endif
+
+inline int detect_simd_width() {
+#ifdef CC_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+        return 8;
+    }
+#endif
+    return 1;
+}
+
+/**
+ * width of the kernels to use: 1 (scalar) or 8 (avx2). can be lowered for testing or tuning.
+ */
+inline int &simd_width() {
+    static int width = detect_simd_width();
+    return width;
+}
+
+/********************************************************************************
+ *
+ * half / int8 quantization
+ *
+ * fp16 uses IEEE binary16 with round-to-nearest-even.
+ * int8 is affine: q = round((x - offset) / scale) clamped to [-127, 127],
+ * x' = q * scale + offset. scale and offset are given per element of a row
+ * (pass the same value everywhere for a single global scale).
+ *
+ ********************************************************************************/
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const uint32_t e    = (x >> 23) & 0xff;
+    uint32_t       mant = x & 0x7fffff;
+    const int32_t  exp  = (int32_t)e - 127 + 15;
+
+    if (e == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0); // inf / nan
+    if (exp >= 31) return sign | 0x7c00;                       // overflow
+    if (exp <= 0) {                                            // subnormal
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        const uint32_t shift = 14 - exp;
+        uint32_t       h     = mant >> shift;
+        const uint32_t rem   = mant & ((1u << shift) - 1);
+        const uint32_t half  = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) h++;
+        return sign | h;
+    }
+
+    uint32_t       h   = ((uint32_t)exp << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++; // a carry rounds up into the exponent
+    return sign | h;
+}
+
+inline float half_to_float(uint16_t h) {
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    const uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t       mant = h & 0x3ff;
+    uint32_t       bits;
+
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else {
+            int e = -1;
+            do {
+                e++;
+                mant <<= 1;
+            } while (!(mant & 0x400));
+            bits = sign | ((uint32_t)(127 - 15 - e) << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if (exp == 31) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+#ifdef CC_SIMD_AVX2
+CC_TARGET_AVX2 inline size_t float_to_half_avx2(const float *src, uint16_t *dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dst + i), h);
+    }
+    return i;
+}
+
+CC_TARGET_AVX2 inline size_t half_to_float_avx2(const uint16_t *src, float *dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+    }
+    return i;
+}
+
+CC_TARGET_AVX2 inline size_t quantize_int8_avx2(const float *src, int8_t *dst, size_t n, const float *inv_scale, const float *offset) {
+    const __m256 lo = _mm256_set1_ps(-127.0f);
+    const __m256 hi = _mm256_set1_ps(127.0f);
+    size_t       i  = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(offset + i)), _mm256_loadu_ps(inv_scale + i));
+        v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+        __m256i q   = _mm256_cvtps_epi32(v); // rounds to nearest even
+        __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packs_epi16(q16, q16));
+    }
+    return i;
+}
+
+CC_TARGET_AVX2 inline size_t dequantize_int8_avx2(const int8_t *src, float *dst, size_t n, const float *scale, const float *offset) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(src + i))));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(q, _mm256_loadu_ps(scale + i)), _mm256_loadu_ps(offset + i)));
+    }
+    return i;
+}
+#endif // ifdef CC_SIMD_AVX2
+
+inline void float_to_half(const float *src, uint16_t *dst, size_t n) {
+    size_t i = 0;
+#ifdef CC_SIMD_AVX2
+    if (simd_width() >= 8) i = float_to_half_avx2(src, dst, n);
+#endif
+    for (; i < n; i++) dst[i] = float_to_half(src[i]);
+}
+
+inline void half_to_float(const uint16_t *src, float *dst, size_t n) {
+    size_t i = 0;
+#ifdef CC_SIMD_AVX2
+    if (simd_width() >= 8) i = half_to_float_avx2(src, dst, n);
+#endif
+    for (; i < n; i++) dst[i] = half_to_float(src[i]);
+}
+
+inline void quantize_int8(const float *src, int8_t *dst, size_t n, const float *inv_scale, const float *offset) {
+    size_t i = 0;
+#ifdef CC_SIMD_AVX2
+    if (simd_width() >= 8) i = quantize_int8_avx2(src, dst, n, inv_scale, offset);
+#endif
+    for (; i < n; i++) {
+        float v = (src[i] - offset[i]) * inv_scale[i];
+        v      = std::min(std::max(v, -127.0f), 127.0f);
+        dst[i] = (int8_t)std::nearbyint(v);
+    }
+}
+
+inline void dequantize_int8(const int8_t *src, float *dst, size_t n, const float *scale, const float *offset) {
+    size_t i = 0;
+#ifdef CC_SIMD_AVX2
+    if (simd_width() >= 8) i = dequantize_int8_avx2(src, dst, n, scale, offset);
+#endif
+    for (; i < n; i++) dst[i] = (float)src[i] * scale[i] + offset[i];
+}
+
 /********************************************************************************
  *
  * is_near